@@ -0,0 +1,425 @@
+/*
+ * manifest.[ch] - binary manifest format for summer and summer-diff
+ *
+ * Copyright (C) 2026 contributors to chiark-utils
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3,
+ * or (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this file; if not, consult the Free Software
+ * Foundation's website at www.fsf.org, or the GNU Project website at
+ * www.gnu.org.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "manifest.h"
+
+const char *const mf_tagnames[MFT_MAX]= {
+  0, "path", "type", "md5", "size", "mode", "uid", "gid",
+  "atime", "mtime", "ctime", "rdev", "target", "hardlink", "problem",
+  "alloc", "btime", "atimens", "mtimens", "ctimens", "btimens",
+  "sha1", "sha256", "sha512", "sha3-256",
+};
+
+const char *const mf_kindnames[MFK_MAX]= {
+  "problem", "file", "dir", "mountpoint", "symlink",
+  "hardlink", "char", "block", "pipe", "sock", "excluded",
+};
+
+/* Order in which summer visits a tree: a directory sorts before its
+ * contents, and siblings by strcmp of their names. */
+static int pathkey(const char *p, size_t l, size_t i) {
+  unsigned char c;
+  if (i>=l) return 0;
+  c= p[i];
+  return c=='/' ? 1 : c+2;
+}
+
+int mf_pathcmp(const char *a, size_t al, const char *b, size_t bl) {
+  size_t i;
+  int ka, kb;
+
+  for (i=0;; i++) {
+    ka= pathkey(a,al,i);
+    kb= pathkey(b,bl,i);
+    if (ka!=kb) return ka-kb;
+    if (!ka) return 0;
+  }
+}
+
+/*---------- writing ----------*/
+
+static uint64_t varint_dec(const unsigned char **pp, const unsigned char *end,
+			   const char *name);
+
+static void grow(unsigned char **buf, size_t *allocd, size_t want) {
+  if (want <= *allocd) return;
+  *allocd= want*2;
+  *buf= mf_realloc(*buf, *allocd);
+}
+
+static size_t varint_enc(unsigned char *p, uint64_t v) {
+  size_t l=0;
+  while (v >= 0x80) { p[l++]= (v & 0x7f) | 0x80;  v >>= 7; }
+  p[l++]= v;
+  return l;
+}
+
+static void write_out(struct mf_writer *w, const void *p, size_t l) {
+  fwrite(p,1,l,w->f);
+  w->offset += l;
+}
+
+static void write_varint(struct mf_writer *w, uint64_t v) {
+  unsigned char b[10];
+  write_out(w, b, varint_enc(b,v));
+}
+
+void mf_start(struct mf_writer *w, FILE *f) {
+  memset(w,0,sizeof(*w));
+  w->f= f;
+  w->flags= MF_FLAG_SORTED;
+  write_out(w, MF_MAGIC, 8);
+}
+
+void mf_put_bytes(struct mf_writer *w, int tag, const void *p, size_t l) {
+  grow(&w->rec, &w->recallocd, w->reclen + 11 + l);
+  w->rec[w->reclen++]= tag;
+  w->reclen += varint_enc(w->rec + w->reclen, l);
+  if (tag==MFT_PATH) { w->pathoff= w->reclen;  w->pathl= l; }
+  memcpy(w->rec + w->reclen, p, l);
+  w->reclen += l;
+}
+
+void mf_put_str(struct mf_writer *w, int tag, const char *s) {
+  mf_put_bytes(w, tag, s, strlen(s));
+}
+
+void mf_put_uint(struct mf_writer *w, int tag, uint64_t v) {
+  unsigned char b[10];
+  mf_put_bytes(w, tag, b, varint_enc(b,v));
+}
+
+void mf_put_time(struct mf_writer *w, int tag, int64_t v) {
+  mf_put_uint(w, tag, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void mf_rec_end(struct mf_writer *w) {
+  const char *path= (const char*)w->rec + w->pathoff;
+  unsigned char *ie;
+
+  if (w->nrecs &&
+      mf_pathcmp(w->lastpath, w->lastpathlen, path, w->pathl) >= 0)
+    w->flags &= ~MF_FLAG_SORTED;
+
+  if (!(w->nrecs % MF_INDEX_STRIDE)) {
+    grow(&w->index, &w->indexallocd, w->indexlen + 20 + w->pathl);
+    ie= w->index + w->indexlen;
+    ie += varint_enc(ie, w->offset);
+    ie += varint_enc(ie, w->pathl);
+    memcpy(ie, path, w->pathl);
+    w->indexlen= ie + w->pathl - w->index;
+    w->nindex++;
+  }
+
+  grow((unsigned char**)&w->lastpath, &w->lastpathallocd, w->pathl);
+  memcpy(w->lastpath, path, w->pathl);
+  w->lastpathlen= w->pathl;
+
+  write_varint(w, w->reclen);
+  write_out(w, w->rec, w->reclen);
+  w->reclen= w->pathl= 0;
+  w->nrecs++;
+}
+
+void mf_rec_rest(const struct mf_writer *w,
+		 void (*each)(void *ctx, const unsigned char *p, size_t l),
+		 void *ctx) {
+  const unsigned char *p, *field, *run, *end;
+  uint64_t fl;
+  int tag;
+
+  run= p= w->rec + w->pathoff + w->pathl;
+  end= w->rec + w->reclen;
+  while (p<end) {
+    field= p;
+    tag= *p++;
+    fl= varint_dec(&p,end,"record being written");
+    p += fl;
+    if (tag!=MFT_ATIME && tag!=MFT_ATIMENS) continue;
+    if (field>run) each(ctx, run, field-run);
+    run= p;
+  }
+  if (end>run) each(ctx, run, end-run);
+}
+
+static void tree_add(struct mf_writer *w, uint64_t start, uint64_t end,
+		     const unsigned char hash[16]) {
+  struct mf_treeent *te;
+
+  if (w->ntree >= w->treeallocd) {
+    w->treeallocd= w->treeallocd ? w->treeallocd*2 : 1024;
+    w->tree= mf_realloc(w->tree, sizeof(*w->tree) * w->treeallocd);
+  }
+  te= &w->tree[w->ntree++];
+  te->start= start;
+  te->end= end;
+  memcpy(te->hash, hash, 16);
+}
+
+void mf_put_tree(struct mf_writer *w, uint64_t start,
+		 const unsigned char hash[16]) {
+  tree_add(w, start, w->offset, hash);
+}
+
+static int treeent_compar(const void *av, const void *bv) {
+  const struct mf_treeent *a=av, *b=bv;
+  return a->start < b->start ? -1 : a->start > b->start;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int l) {
+  while (l--) { *p++= v;  v >>= 8; }
+}
+
+void mf_finish(struct mf_writer *w) {
+  unsigned char trailer[MF_TRAILER_LEN];
+  uint64_t indexoff, treeoff=0;
+  size_t i;
+
+  write_varint(w, 0);
+  indexoff= w->offset;
+  write_varint(w, w->nindex);
+  write_out(w, w->index, w->indexlen);
+
+  if (w->ntree) {
+    /* they were added as each directory was finished */
+    qsort(w->tree, w->ntree, sizeof(*w->tree), treeent_compar);
+    treeoff= w->offset;
+    write_varint(w, w->ntree);
+    for (i=0; i<w->ntree; i++) {
+      write_varint(w, w->tree[i].start);
+      write_varint(w, w->tree[i].end);
+      write_out(w, w->tree[i].hash, 16);
+    }
+  }
+
+  put_le(trailer, indexoff, 8);
+  put_le(trailer+8, treeoff, 8);
+  put_le(trailer+16, w->nrecs, 8);
+  put_le(trailer+24, w->flags, 4);
+  memcpy(trailer+28, MF_TRAILER_MAGIC, 8);
+  write_out(w, trailer, sizeof(trailer));
+
+  free(w->rec);  free(w->index);  free(w->lastpath);  free(w->tree);
+}
+
+/*---------- reading ----------*/
+
+static int fread_varint(FILE *f, const char *name, uint64_t *v_r) {
+  int c, shift;
+  uint64_t v=0;
+
+  for (shift=0; ; shift+=7) {
+    c= getc(f);
+    if (c==EOF) {
+      if (ferror(f)) mf_corrupt(name, "read error");
+      if (!shift) return 0;
+      mf_corrupt(name, "truncated");
+    }
+    if (shift>=64) mf_corrupt(name, "varint too long");
+    v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) break;
+  }
+  *v_r= v;
+  return 1;
+}
+
+static int read_varint(struct mf_reader *r, uint64_t *v_r) {
+  return fread_varint(r->f, r->name, v_r);
+}
+
+static uint64_t varint_dec(const unsigned char **pp, const unsigned char *end,
+			   const char *name) {
+  const unsigned char *p= *pp;
+  uint64_t v=0;
+  int shift;
+
+  for (shift=0; ; shift+=7) {
+    if (p>=end || shift>=64) mf_corrupt(name, "bad varint in record");
+    v |= (uint64_t)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) break;
+  }
+  *pp= p;
+  return v;
+}
+
+void mf_open(struct mf_reader *r, FILE *f, const char *name) {
+  char magic[8];
+
+  memset(r,0,sizeof(*r));
+  r->f= f;
+  r->name= name;
+  if (fread(magic,1,8,f) != 8 || memcmp(magic,MF_MAGIC,8))
+    mf_corrupt(name, ferror(f) ? "read error" : "not a summer manifest");
+}
+
+int mf_read(struct mf_reader *r) {
+  uint64_t l, fl;
+  const unsigned char *p, *end;
+  int tag;
+
+  memset(r->fields,0,sizeof(r->fields));
+  r->off= ftello(r->f);
+  if (!read_varint(r,&l)) mf_corrupt(r->name, "truncated");
+  if (!l) return 0;
+
+  r->recl= l;
+  grow(&r->rec, &r->recallocd, l);
+  if (fread(r->rec,1,l,r->f) != l)
+    mf_corrupt(r->name, ferror(r->f) ? "read error" : "truncated");
+
+  for (p=r->rec, end=r->rec+l; p<end; p+=fl) {
+    tag= *p++;
+    fl= varint_dec(&p,end,r->name);
+    if (fl > end-p) mf_corrupt(r->name, "field overruns record");
+    if (tag<=0 || tag>=MFT_MAX) continue;
+    r->fields[tag].p= p;
+    r->fields[tag].l= fl;
+    r->fields[tag].present= 1;
+  }
+  if (!r->fields[MFT_PATH].present) mf_corrupt(r->name, "record lacks path");
+  return 1;
+}
+
+static uint64_t get_le(const unsigned char *p, int l) {
+  uint64_t v=0;
+  while (l--) v= (v<<8) | p[l];
+  return v;
+}
+
+/* 0 if f is not seekable */
+static int read_trailer(FILE *f, const char *name,
+			unsigned char trailer[MF_TRAILER_LEN]) {
+  if (fseeko(f, -(off_t)MF_TRAILER_LEN, SEEK_END)) return 0;
+  if (fread(trailer,1,MF_TRAILER_LEN,f) != MF_TRAILER_LEN ||
+      memcmp(trailer+28, MF_TRAILER_MAGIC, 8))
+    mf_corrupt(name, "bad trailer");
+  return 1;
+}
+
+int mf_seek(struct mf_reader *r, const char *path, size_t pathl) {
+  unsigned char trailer[MF_TRAILER_LEN];
+  uint64_t n, off, el, best=8;
+  char *ep=0;
+  size_t epallocd=0;
+
+  if (!read_trailer(r->f, r->name, trailer)) return 0;
+  if (!(get_le(trailer+24,4) & MF_FLAG_SORTED))
+    goto unsorted;
+  if (fseeko(r->f, get_le(trailer,8), SEEK_SET))
+    mf_corrupt(r->name, "cannot seek to index");
+
+  if (!read_varint(r,&n)) mf_corrupt(r->name, "truncated index");
+  while (n--) {
+    if (!read_varint(r,&off) || !read_varint(r,&el))
+      mf_corrupt(r->name, "truncated index");
+    grow((unsigned char**)&ep, &epallocd, el);
+    if (fread(ep,1,el,r->f) != el) mf_corrupt(r->name, "truncated index");
+    if (mf_pathcmp(ep,el, path,pathl) >= 0) break;
+    best= off;
+  }
+  free(ep);
+  if (fseeko(r->f, best, SEEK_SET)) mf_corrupt(r->name, "cannot seek");
+  return 1;
+
+ unsorted:
+  if (fseeko(r->f, 8, SEEK_SET)) mf_corrupt(r->name, "cannot seek");
+  return -1;
+}
+
+int mf_tree_open(struct mf_tree *t, const char *name) {
+  unsigned char trailer[MF_TRAILER_LEN];
+  uint64_t off;
+
+  memset(t,0,sizeof(*t));
+  t->name= name;
+  t->f= fopen(name,"rb");
+  if (!t->f) return 0;
+  if (!read_trailer(t->f, name, trailer) ||
+      !(off= get_le(trailer+8,8))) {
+    fclose(t->f);  t->f= 0;
+    return 0;
+  }
+  if (fseeko(t->f, off, SEEK_SET) || !fread_varint(t->f, name, &t->left))
+    mf_corrupt(name, "bad tree hashes");
+  return 1;
+}
+
+int mf_tree_find(struct mf_tree *t, uint64_t start) {
+  while (!t->have || t->cur.start < start) {
+    if (!t->left) { t->have= 0; return 0; }
+    if (!fread_varint(t->f, t->name, &t->cur.start) ||
+	!fread_varint(t->f, t->name, &t->cur.end) ||
+	fread(t->cur.hash,1,16,t->f) != 16)
+      mf_corrupt(t->name, "truncated tree hashes");
+    t->left--;
+    t->have= 1;
+  }
+  return t->cur.start == start;
+}
+
+void mf_append(struct mf_writer *w, FILE *f, const char *name) {
+  unsigned char trailer[MF_TRAILER_LEN], hash[16];
+  struct mf_reader r;
+  uint64_t delta, n, start, end;
+
+  if (fseeko(f, 0, SEEK_SET)) mf_corrupt(name, "cannot rewind");
+  mf_open(&r, f, name);
+  /* records in f start at 8; that is where w is now */
+  delta= w->offset - 8;
+
+  while (mf_read(&r)) {
+    grow(&w->rec, &w->recallocd, r.recl);
+    memcpy(w->rec, r.rec, r.recl);
+    w->reclen= r.recl;
+    w->pathoff= r.fields[MFT_PATH].p - r.rec;
+    w->pathl= r.fields[MFT_PATH].l;
+    mf_rec_end(w);
+  }
+  free(r.rec);
+
+  if (!read_trailer(f, name, trailer)) mf_corrupt(name, "cannot seek");
+  if (!(start= get_le(trailer+8,8))) return;
+  if (fseeko(f, start, SEEK_SET) || !fread_varint(f, name, &n))
+    mf_corrupt(name, "bad tree hashes");
+  while (n--) {
+    if (!fread_varint(f, name, &start) ||
+	!fread_varint(f, name, &end) ||
+	fread(hash,1,16,f) != 16)
+      mf_corrupt(name, "truncated tree hashes");
+    tree_add(w, start+delta, end+delta, hash);
+  }
+}
+
+uint64_t mf_get_uint(const struct mf_field *fi) {
+  const unsigned char *p= fi->p;
+  return varint_dec(&p, fi->p + fi->l, "field");
+}
+
+int64_t mf_get_time(const struct mf_field *fi) {
+  uint64_t v= mf_get_uint(fi);
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
@@ -0,0 +1,176 @@
+/*
+ * manifest.[ch] - binary manifest format for summer and summer-diff
+ *
+ * Copyright (C) 2026 contributors to chiark-utils
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3,
+ * or (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this file; if not, consult the Free Software
+ * Foundation's website at www.fsf.org, or the GNU Project website at
+ * www.gnu.org.
+ */
+/*
+ * File layout (all integers are LEB128 varints unless stated):
+ *
+ *   magic            8 bytes, MF_MAGIC
+ *   record...        length L, then L bytes of fields
+ *   end of records   length 0
+ *   index            count, then count x { offset, pathlen, path }
+ *   tree hashes      count, then count x { start, end, 16-byte hash }
+ *   trailer          index offset (u64le), tree hashes offset (u64le,
+ *                    0 if absent), record count (u64le),
+ *                    flags (u32le), MF_TRAILER_MAGIC (8 bytes)
+ *
+ * Each field is a tag byte, a length, and that many bytes of data.
+ * Unsigned numbers are varints; times are zigzag-encoded varints.
+ * Readers ignore tags they do not know.  A field is present only if
+ * the corresponding text column would have shown a value.
+ *
+ * Records appear in the order summer visits them.  Within each
+ * startpoint that is mf_pathcmp order; MF_FLAG_SORTED says whether
+ * it held for the whole file.  The index has an entry for every
+ * MF_INDEX_STRIDE'th record.
+ *
+ * Tree hashes (summer -T) are Merkle hashes of directories' contents,
+ * in the same order as the directories' records.  start is the offset
+ * of the directory's record and end the offset just past its last
+ * descendant.  The hash is MD5 over, for each child in turn: its
+ * name, a nul, its record less the path and atime fields, and (if it
+ * is a directory which was descended into) its own tree hash.  atimes
+ * are left out because summer's own reading changes them.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MF_MAGIC          "SUMMER\0\1"
+#define MF_TRAILER_MAGIC  "SUMMERIX"
+#define MF_TRAILER_LEN    36
+#define MF_INDEX_STRIDE   1024
+#define MF_FLAG_SORTED    1u
+
+enum {
+  MFT_PATH=1,      /* raw bytes, not escaped */
+  MFT_KIND,        /* MFK_* */
+  MFT_MD5,         /* 16 bytes */
+  MFT_SIZE,
+  MFT_MODE,
+  MFT_UID,
+  MFT_GID,
+  MFT_ATIME,
+  MFT_MTIME,
+  MFT_CTIME,
+  MFT_RDEV,
+  MFT_TARGET,      /* symlink target */
+  MFT_HARDLINK,    /* path of earlier link to the same object */
+  MFT_PROBLEM,     /* text of any problems (-f) */
+  MFT_ALLOC,       /* allocated size in bytes (-a) */
+  MFT_BTIME,       /* birth time (-W) */
+  MFT_ATIMENS,     /* nanoseconds part of the corresponding time (-n) */
+  MFT_MTIMENS,
+  MFT_CTIMENS,
+  MFT_BTIMENS,
+  MFT_SHA1,        /* other content hashes (-H) */
+  MFT_SHA256,
+  MFT_SHA512,
+  MFT_SHA3_256,
+  MFT_MAX
+};
+
+enum {
+  MFK_PROBLEM, MFK_FILE, MFK_DIR, MFK_MOUNTPOINT, MFK_SYMLINK,
+  MFK_HARDLINK, MFK_CHR, MFK_BLK, MFK_PIPE, MFK_SOCK,
+  MFK_EXCLUDED,    /* not looked at (summer -S) */
+  MFK_MAX
+};
+
+extern const char *const mf_tagnames[MFT_MAX];
+extern const char *const mf_kindnames[MFK_MAX];
+
+int mf_pathcmp(const char *a, size_t al, const char *b, size_t bl);
+
+/* writing */
+
+struct mf_writer {
+  FILE *f;
+  uint64_t offset, nrecs;
+  unsigned flags;
+  unsigned char *rec;  size_t reclen, recallocd, pathoff, pathl;
+  unsigned char *index;  size_t indexlen, indexallocd;  uint64_t nindex;
+  char *lastpath;  size_t lastpathlen, lastpathallocd;
+  struct mf_treeent *tree;  size_t ntree, treeallocd;
+};
+
+struct mf_treeent { uint64_t start, end;  unsigned char hash[16]; };
+
+void mf_start(struct mf_writer *w, FILE *f);
+void mf_put_bytes(struct mf_writer *w, int tag, const void *p, size_t l);
+void mf_put_str(struct mf_writer *w, int tag, const char *s);
+void mf_put_uint(struct mf_writer *w, int tag, uint64_t v);
+void mf_put_time(struct mf_writer *w, int tag, int64_t v);
+void mf_rec_end(struct mf_writer *w);
+void mf_rec_rest(const struct mf_writer *w,
+		 void (*each)(void *ctx, const unsigned char *p, size_t l),
+		 void *ctx);
+  /* calls each for the fields of the current record after its path
+   * (put first), in order, but leaving out the atime fields */
+void mf_put_tree(struct mf_writer *w, uint64_t start,
+		 const unsigned char hash[16]); /* end is now */
+void mf_finish(struct mf_writer *w); /* caller must then check/close f */
+void mf_append(struct mf_writer *w, FILE *f, const char *name);
+  /* copies in all the records (and tree hashes) from the finished
+   * manifest in f, as if they had been written to w directly */
+
+/* reading */
+
+struct mf_field { const unsigned char *p; size_t l; int present; };
+
+struct mf_reader {
+  FILE *f;
+  const char *name;
+  unsigned char *rec;  size_t recl, recallocd;
+  int64_t off; /* of current record, or -1 if not seekable */
+  struct mf_field fields[MFT_MAX];
+};
+
+struct mf_tree {
+  FILE *f;
+  const char *name;
+  uint64_t left;
+  int have;
+  struct mf_treeent cur;
+};
+
+void mf_open(struct mf_reader *r, FILE *f, const char *name);
+int mf_read(struct mf_reader *r); /* 1 = got record, 0 = end */
+int mf_seek(struct mf_reader *r, const char *path, size_t pathl);
+  /* positions r at or before the first record >= path and returns 1;
+   * returns 0 if the file is not seekable, or -1 if it is not sorted
+   * (in both cases r is left at the first record) */
+int mf_tree_open(struct mf_tree *t, const char *name);
+  /* opens name separately; 0 if it has no tree hashes */
+int mf_tree_find(struct mf_tree *t, uint64_t start);
+  /* finds entry for the directory at start; t->cur is then valid;
+   * successive calls must have nondecreasing start */
+uint64_t mf_get_uint(const struct mf_field *fi);
+int64_t mf_get_time(const struct mf_field *fi);
+
+/* to be provided by program: */
+void mf_corrupt(const char *name, const char *what);
+void *mf_malloc(size_t sz);
+void *mf_realloc(void *p, size_t sz);
+
+#endif /*MANIFEST_H*/
@@ -23,6 +23,16 @@
  *   (none)     Default: start new server if needed, then run service
  *   -f         Force a fresh service (old one is terminated)
  *   --kill     Kill any existing service; do not actually run anything
+ *   --batch    Run the script many times, one call after another,
+ *              usually all over one connection to the server.  Reads
+ *              argument vectors from stdin: each argument followed by
+ *              a nul, and each vector by a further nul (so arguments
+ *              cannot be empty).  Each call's arguments are those
+ *              given to prefork-interp followed by one vector.  Its
+ *              stdin is /dev/null; stdout and stderr are ours.  After
+ *              each call, prints its exit status (128+N for signal N)
+ *              on a line to stdout.  Exits 0 if every call exited 0,
+ *              or 1 otherwise.
  *
  * Options for controlling whether different invocations share a server:
  *
@@ -32,6 +42,34 @@
  *
  * (Ordering of -E and -G options is relevant; invocations with different
  * -E -G options are different even if the env var settings are the same)
+ *
+ * Options for diagnostics:
+ *
+ *   --trace=DEST  Record when each stage of the invocation happened,
+ *                 as one line "prefork-interp-trace KEY=VALUE ..." per
+ *                 invocation, appended to the file DEST, or sent to
+ *                 syslog (LOG_USER, LOG_INFO) if DEST is "syslog".
+ *                 The environment variable PREFORK_INTERP_TRACE=DEST
+ *                 does the same, and overrides the option; the option
+ *                 sets the variable, so the script sees it either way.
+ *
+ *     The keys are t (the wall clock time at the end), ident, pid,
+ *     spawned (1 if we started the server), attempts, and wstatus, and
+ *     then times, in microseconds since we started:
+ *         connect    connected (or set up the server we spawned)
+ *                    (with --batch, connect and greeting are absent
+ *                    for calls made over an existing connection)
+ *         fds        sent the signalling byte and the fds
+ *         sent       sent the whole request (usually the same as fds)
+ *         greeting   read the greeting
+ *         accept     server accepted the call (not if we spawned it)
+ *         received   monitor had the whole request
+ *         fork       monitor forked the executor, or passed the call
+ *                    to one forked in advance
+ *         exec       executor about to return to the script
+ *         status     read the wait status
+ *     Times from the server side are present only if it supports
+ *     tracing.  Later versions may add keys.
  */
 
 /*
@@ -230,8 +268,8 @@
  
    [client (C wrapper)]      if client connect succeeds:
                              now fd: call(client-end)
-                                sends message with: cmdline, env
-                                sends fds
+                                sends fds, and message with: cmdline, env
+                                (all in one sendmmsg, before the greeting)
  
          [server (script)]   accepts, forks subseq monitor
  
@@ -273,7 +311,7 @@
 
   2. Env var PREFORK_INTERP contains:
 
-         v1,SECS.NSECS[,...] LISTEN,CALL,WATCHE,WATCHI[,...][ ???]
+         v1,SECS.NSECS[,v2][,...] LISTEN,CALL,WATCHE,WATCHI[,...][ ???]
 
      To parse it: treat as bytes and split on ASCII space, taking
      the first two words.  (There may or may not be
@@ -289,6 +327,40 @@
               decimal time_t.  NSECS is exactly 9 digits.
               To be used for auto reloading (see below).
 
+     Further items name protocol variants the client may use:
+
+        v2    The client may send its request (part 4 steps 4-7)
+              before it has read the greeting (part 4 step 3).  The
+              bytes sent are the same as for v1, so this makes no
+              difference to a script which sends its greeting before
+              reading anything, as it must anyway.
+              Clients which do not say v2 read the length of the
+              greeting's xdata in host byte order, so the script
+              must not send them any xdata.  The script only knows
+              what the client which spawned it said, so it sends
+              xdata only in the initial monitor's first greeting,
+              to that client (see part 4 step 7).
+
+        watch The watcher can watch files for the script, so that it
+              need not stat them itself (part 3 step 7(A)(i)).  The
+              script may write to WATCHI the names of the files
+              forming part of the program, each followed by a nul.
+              If one is renamed or deleted, or its mtime becomes
+              later than SECS.NSECS, the watcher writes
+              "reload NAME\n" to WATCHE and exits.  If it cannot
+              watch one, it writes "unwatched NAME\n", and the
+              script must check that one itself.  (Without watch,
+              anything written to WATCHI makes the watcher exit.)
+              If the script first writes an empty name (just a nul),
+              the watcher instead tries a warm reload: it starts a
+              fresh server itself, listening on n<ident> in the run
+              directory.  Once that server's setup has exited
+              successfully, and its initial monitor has sent the
+              greeting (the watcher then hangs up, without sending a
+              request), it renames n<ident> over the socket, and
+              exits, so the script sees EOF on WATCHE (7B).  Only if
+              that fails does it write "reload NAME\n".
+
      The 2nd word's items are file descriptors:
 
         LISTEN   listening socket                 nonblocking
@@ -314,19 +386,32 @@
 
         A. accept on LISTEN:
             i. see if we need to reload: is any file forming part
-               of the program newer than the SECS.NSECS ?
+               of the program (and not being watched by the watcher)
+               newer than the SECS.NSECS ?
                If so, log at LOG_INFO, and exit immediately
                (dropping CALL, LISTEN, WATCHI, etc.)
             ii. see if we can reap any children, possibly waiting
                for children if we are at our concurrency limit
-               (limit should be configured through library, default 4)
+               (limit should be configured through library, default 4;
+               the library may vary it according to load)
                Report child exit status if not zero or SIGPIPE.
             iii. fork service (monitor) child, using accepted fd
 
         B. WATCHE is readable:
-            * EOF: log at LOG_INFO, and exit
+            * EOF: log at LOG_INFO, and exit (perhaps after accepting
+              calls already waiting on LISTEN, which would otherwise
+              be dropped and have to retry)
             * data to read: read what is available immediately;
-              it will be an error message: log it at LOG_ERR, and exit
+              it will be "reload" or "unwatched" (see watch, above),
+              or otherwise an error message: log it at LOG_ERR, and exit
+
+        Optionally (Proc::Prefork::Interp's spare_servers), the library
+        may instead keep a few "spare" service (monitor) children,
+        forked in advance, which each wait for LISTEN to be readable
+        and accept a call themselves, doing the reload check of 7(A)(i)
+        first.  They must exit if the server does.  Each spare may also
+        fork its executor in advance (part 4 step 9) and pass it the
+        call's fds and message once they have been received.
 
   4. service (monitor) child does the following:
 
@@ -344,6 +429,22 @@
             * an empty string
             * arguments NOT INCLUDING argv[0] or script filename
          (not that this means the service request must end in a nul)
+         The initial monitor's first greeting, to the client which
+         spawned the server, may instead have a nonzero length, if
+         that client said v2, followed by that many bytes of
+         nul-terminated KEY=VALUE items; the client ignores ones it
+         does not understand.  All other greetings have length 0,
+         since they may be to older clients.  If it includes
+         envhash=HASH, HASH is the sha256 (in hex) of the script's
+         baseline environment: its own, at startup, less PREFORK_INTERP,
+         as sorted NAME=value strings each followed by a nul.  The
+         client records the baseline it gave the script in e<ident> in
+         the run directory, and thereafter may send, instead of the
+         environment, "=HASH" followed by the differences from it:
+         NAME=value to set, and NAME (without =) to unset.  If HASH is
+         not that of its baseline, the monitor writes the status
+         0xffffffff and exits; the client then calls again, sending
+         the whole environment.
       8. make a new pipe EXECTERM
       9. fork for the service executor; in the child
             i. redirect stdin/stdout/stderr to the recevied fds
@@ -361,10 +462,29 @@
           No need to actually read, since these shouldn't produce
           spurious wakeups (but do loop on EINTR).
       12. set SIGINT to ignored
-      13. send SIGINT to the entire process group
+      13. if CALL was readable, send SIGINT to the entire process group
       14. wait, blocking, for the executor child
-      15. write the wait status, in 32-bit big-endian, to CAL
-      16. exit 0
+      15. send SIGINT to the entire process group, to get rid of anything
+          the executor left behind (this must be after the wait, lest it
+          kill an executor which is still in the middle of exiting)
+      16. write the wait status, in 32-bit big-endian, to CALL,
+          followed, if the environment received contains
+          PREFORK_INTERP_TRACE (nonempty), by a 4-byte big-endian length
+          and that many bytes of nul-terminated KEY=VALUE trace items,
+          whose values are CLOCK_MONOTONIC times in nanoseconds
+      17. exit 0
+
+     Alternatively, at step 16, if its server is still running, the
+     monitor may offer to handle another call on the same connection
+     by sending a greeting (as in step 3) straight after the status
+     (and any trace items).  It then carries on from step 4, with its
+     environment reset to the baseline, and SIGINT set back to default
+     before it forks the next executor.  EOF at step 4 means the client
+     has finished: exit 0.  The client must not send another request
+     until it has read the status, since the monitor would take CALL
+     becoming readable during the call to mean the client has gone
+     away.  Clients which make only one call ignore the greeting.
+     If it gets EOF instead, the client connects afresh.
 
      Errors detected in the service monitor should be sent to
      syslog, or stderr, depending on whether this is the initial
@@ -382,20 +502,27 @@
 
 */
 
+#include "prefork.h"
+
 #include <arpa/inet.h>
 #include <sys/utsname.h>
 
 #include <uv.h>
 
-#include "prefork.h"
+#include "timespeccmp.h"
 
 const char our_name[] = "prefork-interp";
 
 static struct sockaddr_un sockaddr_sun;
 static FILE *call_sock;
+static int call_fds[3] = { 0, 1, 2 }; // the executor's stdin, stdout, stderr
 
 #define ACK_BYTE '\n'
 
+#define STATUS_RESEND_FULL_ENV 0xffffffffUL
+
+#define TRACE_ENV "PREFORK_INTERP_TRACE"
+
 static const char *const *executor_argv;
 
 static const char header_magic[4] = "PFI\n";
@@ -414,14 +541,19 @@ void fusagemessage(FILE *f) {
 static int mediation = MEDIATION_UNSPECIFIED;
 static int mode = MODE_NORMAL;
 static int max_sockets = 100; // maximum entries in the run dir is 2x this
+static int batch;
 
 static struct stat initial_stab;
 
+static const char *trace_dest; // 0 means not tracing
+
 const struct cmdinfo cmdinfos[]= {
   PREFORK_CMDINFOS
   { 0,         'U',   0, .iassignto= &mediation, .arg= MEDIATION_UNLAUNDERED },
   { "kill",     0,    0, .iassignto= &mode,      .arg= MODE_KILL   },
   { 0,         'f',   0, .iassignto= &mode,      .arg= MODE_FRESH  },
+  { "batch",    0,    0, .iassignto= &batch,     .arg= 1           },
+  { "trace",    0,    1, .sassignto= &trace_dest                   },
   { 0 }
 };
 
@@ -494,6 +626,48 @@ static void propagate_exit_status(int status, const char *what) {
   die("%s failed with weird wait status %d 0x%x", what, status, status);
 }
 
+//---------- tracing ----------
+
+enum {
+  TR_START, TR_CONNECT, TR_FDS, TR_SENT, TR_GREETING, TR_STATUS, TR_MAX
+};
+static const char *const trace_names[TR_MAX] = {
+  0, "connect", "fds", "sent", "greeting", "status"
+};
+static struct timespec trace_ts[TR_MAX];
+static bool trace_spawned;
+static int trace_attempts;
+
+static void trace_stamp(int which) {
+  if (!trace_dest) return;
+  int r = clock_gettime(CLOCK_MONOTONIC, &trace_ts[which]);
+  if (r) diee("clock_gettime");
+}
+
+static long long trace_ns(const struct timespec *ts) {
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void trace_init(void) {
+  const char *env = getenv(TRACE_ENV);
+  if (env && *env) {
+    trace_dest = env;
+  } else if (trace_dest && *trace_dest) {
+    if (setenv(TRACE_ENV, trace_dest, 1)) diee("setenv %s", TRACE_ENV);
+  } else {
+    trace_dest = 0;
+  }
+  trace_stamp(TR_START);
+}
+
+// Each call in a batch gets its own trace line
+static void trace_restart(void) {
+  FILLZERO(trace_ts);
+  trace_spawned = 0;
+  trace_attempts = 0;
+  trace_stamp(TR_START);
+}
+
 typedef struct {
   char *name_hash;
   time_t atime;
@@ -522,13 +696,94 @@ static time_t preclean_stat_atime(const char *s_path) {
   return stab.st_atime;
 }
 
-static void preclean(void) {
-  DIR *dir = opendir(run_base);
-  if (!dir) {
-    if (errno == ENOENT) return;
-    diee("pre-cleanup: open run dir (%s)", run_base);
+// The index lists the idents which have servers (or had, anyway),
+// least recently spawned first:
+//    prefork-interp run dir index v1
+//    + IDENT
+//    ...
+//    .
+// It is read, and rewritten in place, with it locked.  If it is
+// missing or damaged, we rebuild it by scanning the whole run dir.
+
+#define INDEX_MAGIC "prefork-interp run dir index v1\n"
+
+static const char *index_path;
+
+// Returns false if the index is missing or damaged
+static bool index_read(int index_fd, PrecleanEntry **entries_r,
+		       size_t *used_r) {
+  struct stat stab;
+  if (fstat(index_fd, &stab)) diee("pre-cleanup: fstat index");
+  if (stab.st_size < sizeof(INDEX_MAGIC)-1 + 2 ||
+      stab.st_size > 1024*1024)
+    return 0;
+
+  char *buf = xmalloc(stab.st_size + 1);
+  ssize_t got = pread(index_fd, buf, stab.st_size, 0);
+  if (got < 0) diee("pre-cleanup: read index (%s)", index_path);
+  bool ok = 0;
+  if (got != stab.st_size) goto out;
+  buf[got] = 0;
+
+  if (memcmp(buf, INDEX_MAGIC, sizeof(INDEX_MAGIC)-1)) goto out;
+  if (strcmp(buf + got - 2, ".\n") || buf[got - 3] != '\n') goto out;
+
+  PrecleanEntry *entries = 0;
+  size_t used = 0, avail = 0;
+  char *line = buf + sizeof(INDEX_MAGIC)-1, *nl;
+  for (; line != buf + got - 2; line = nl + 1) {
+    nl = memchr(line, '\n', buf + got - line);
+    if (line[0] != '+' || line[1] != ' ' || nl == line+2 ||
+	memchr(line, '/', nl - line)) {
+      while (used) free(entries[--used].name_hash);
+      free(entries);
+      goto out;
+    }
+    if (avail == used) {
+      avail <<= 1;
+      avail += 10;
+      entries = realloc(entries, avail * sizeof(PrecleanEntry));
+      if (!entries) diee("pre-cleanup: allocate");
+    }
+    entries[used].name_hash = m_asprintf("%.*s", (int)(nl - line - 2),
+					 line + 2);
+    entries[used].atime = 0;
+    used++;
   }
 
+  *entries_r = entries;
+  *used_r = used;
+  ok = 1;
+
+ out:
+  free(buf);
+  return ok;
+}
+
+static void index_write(int index_fd, PrecleanEntry *entries, size_t used) {
+  char *buf = 0;
+  size_t len = 0;
+  FILE *f = open_memstream(&buf, &len);
+  if (!f) diee("pre-cleanup: open_memstream");
+  fputs(INDEX_MAGIC, f);
+  PrecleanEntry *p;
+  for (p=entries; p < entries + used; p++)
+    fprintf(f, "+ %s\n", p->name_hash);
+  fputs(".\n", f);
+  if (fclose(f)) diee("pre-cleanup: format index");
+
+  ssize_t wr = pwrite(index_fd, buf, len, 0);
+  if (wr != (ssize_t)len) diee("pre-cleanup: write index (%s)", index_path);
+  if (ftruncate(index_fd, len))
+    diee("pre-cleanup: truncate index (%s)", index_path);
+  free(buf);
+}
+
+// Finds all the servers, least recently started first
+static void index_rebuild(PrecleanEntry **entries_r, size_t *used_r) {
+  DIR *dir = opendir(run_base);
+  if (!dir) diee("pre-cleanup: open run dir (%s)", run_base);
+
   PrecleanEntry *entries=0;
   size_t avail_entries=0;
   size_t used_entries=0;
@@ -540,29 +795,70 @@ static void preclean(void) {
     char *name_hash = m_asprintf("%s", de->d_name+1);
     char *s_path = m_asprintf("%s/s%s", run_base, name_hash);
     time_t atime = preclean_stat_atime(s_path);
+    free(s_path);
 
     if (avail_entries == used_entries) {
       assert(avail_entries < INT_MAX / 4 / sizeof(PrecleanEntry));
       avail_entries <<= 1;
       avail_entries += 10;
       entries = realloc(entries, avail_entries * sizeof(PrecleanEntry));
+      if (!entries) diee("pre-cleanup: allocate");
     }
     entries[used_entries].name_hash = name_hash;
     entries[used_entries].atime = atime;
     used_entries++;
   }
   if (errno) diee("pre-cleanup: read run dir (%s)", run_base);
+  closedir(dir);
 
   // First we dedupe (after sorting by path)
   qsort(entries, used_entries, sizeof(PrecleanEntry),
 	preclean_entry_compar_name);
   PrecleanEntry *p, *q;
   for (p=entries, q=entries; p < entries + used_entries; p++) {
-    if (q > entries && !strcmp(p->name_hash, (q-1)->name_hash))
+    if (q > entries && !strcmp(p->name_hash, (q-1)->name_hash)) {
+      free(p->name_hash);
+      continue;
+    }
+    *q++ = *p;
+  }
+  used_entries = q - entries;
+
+  qsort(entries, used_entries, sizeof(PrecleanEntry),
+	preclean_entry_compar_atime);
+
+  *entries_r = entries;
+  *used_r = used_entries;
+}
+
+// We are about to start a server for ident.  Records that in the
+// index, and deletes the least recently started servers' sockets if
+// there are too many.  (The servers notice, and quit.)
+static void preclean(void) {
+  PrecleanEntry *entries=0;
+  size_t used_entries=0;
+
+  int index_fd = flock_file(index_path);
+  if (!index_read(index_fd, &entries, &used_entries))
+    index_rebuild(&entries, &used_entries);
+
+  // We are now the most recent
+  PrecleanEntry *p, *q;
+  char *us_name = 0;
+  for (p=entries, q=entries; p < entries + used_entries; p++) {
+    if (!strcmp(p->name_hash, ident)) {
+      free(us_name);
+      us_name = p->name_hash;
       continue;
+    }
     *q++ = *p;
   }
   used_entries = q - entries;
+  entries = realloc(entries, (used_entries+1) * sizeof(PrecleanEntry));
+  if (!entries) diee("pre-cleanup: allocate");
+  entries[used_entries].name_hash = us_name ?: m_asprintf("%s", ident);
+  entries[used_entries].atime = 0;
+  used_entries++;
 
   // Now maybe delete some things
   //
@@ -570,29 +866,45 @@ static void preclean(void) {
   // to create a socket, so the actual number of sockets is one more.
   // But, *actually*, since there might be multiple of us running at once,
   // we might have even more than that.  This doesn't really matter.
-  if (used_entries > max_sockets) {
-    qsort(entries, used_entries, sizeof(PrecleanEntry),
-	  preclean_entry_compar_atime);
-    for (p=entries; p < entries + max_sockets; p++) {
-      char *l_path = m_asprintf("%s/l%s", run_base, p->name_hash);
-      char *s_path = m_asprintf("%s/s%s", run_base, p->name_hash);
-      int lock_fd = flock_file(l_path);
-      // Recheck atime - we might have raced!
-      time_t atime = preclean_stat_atime(s_path);
-      if (atime != p->atime) {
-	// Raced.  This will leave use deleting too few things.  Whatever.
-      } else {
-	int r= unlink(s_path);
-	if (r && errno!=ENOENT) diee("preclean: delete stale (%s)", s_path);
-	r= unlink(l_path);
-	if (r) diee("preclean: delete stale lock (%s)", s_path);
-	// NB we don't hold the lock any more now.
-      }
-      close(lock_fd);
+  //
+  // Anyone else starting one of these servers would have to have
+  // updated the index first, so we needn't worry about racing them.
+  // But someone may be connecting to, or still starting, one of the
+  // victims; we mustn't wait for them with the index locked, so we
+  // leave those in the index for next time.
+  size_t evict = used_entries > max_sockets ? max_sockets : 0;
+  for (p=entries, q=entries; p < entries + evict; p++) {
+    char *l_path = m_asprintf("%s/l%s", run_base, p->name_hash);
+    int lock_fd = flock_file_try(l_path);
+    if (lock_fd < 0) {
       free(l_path);
-      free(s_path);
+      *q++ = *p;
+      continue;
     }
+    char *s_path = m_asprintf("%s/s%s", run_base, p->name_hash);
+    char *e_path = m_asprintf("%s/e%s", run_base, p->name_hash);
+    char *n_path = m_asprintf("%s/n%s", run_base, p->name_hash);
+    int r= unlink(s_path);
+    if (r && errno!=ENOENT) diee("preclean: delete stale (%s)", s_path);
+    r= unlink(e_path);
+    if (r && errno!=ENOENT) diee("preclean: delete stale (%s)", e_path);
+    r= unlink(n_path);
+    if (r && errno!=ENOENT) diee("preclean: delete stale (%s)", n_path);
+    r= unlink(l_path);
+    if (r) diee("preclean: delete stale lock (%s)", s_path);
+    // NB we don't hold the lock any more now.
+    close(lock_fd);
+    free(l_path);
+    free(s_path);
+    free(e_path);
+    free(n_path);
+    free(p->name_hash);
   }
+  memmove(q, entries + evict, (used_entries - evict) * sizeof(PrecleanEntry));
+  used_entries -= evict - (q - entries);
+
+  index_write(index_fd, entries, used_entries);
+  close(index_fd);
 
   for (p=entries; p < entries + used_entries; p++)
     free(p->name_hash);
@@ -627,75 +939,194 @@ static void prepare_string(size_t *len, char **buf, const char *s) {
   prepare_data(len, buf, s, sl+1);
 }
 
-static void prepare_message(size_t *len, char **buf) {
-  const char *s;
+//---------- environment deltas ----------
+//
+// The spawning client records the environment it gave the server
+// (the "baseline") in e<ident> in the run dir, if the server says
+// it can take deltas from it.  Later clients send only the variables
+// which differ from that.
 
-  const char *const *p = (void*)environ;
-  while ((s = *p++)) {
-    if (strchr(s, '='))
-      prepare_string(len, buf, s);
-  }
+typedef struct {
+  const char *s;   // NAME=value, or (in a delta) NAME to unset it
+  size_t namelen;
+} EnvEntry;
+
+#define ENVHASH_HEXLEN (SHA256_DIGEST_SIZE*2)
+
+static EnvEntry *env_send;       // what we will send
+static size_t env_send_n;
+static char env_delta_hash[ENVHASH_HEXLEN+1]; // nonempty: env_send is delta
+static bool env_delta_ok = 1;
+static char greeting_envhash[ENVHASH_HEXLEN+1];
+static const char *env_path;
+
+static int env_entry_compar(const void *av, const void *bv) {
+  const EnvEntry *a = av;
+  const EnvEntry *b = bv;
+  int c = memcmp(a->s, b->s, a->namelen < b->namelen
+		 ? a->namelen : b->namelen);
+  if (c) return c;
+  return (a->namelen > b->namelen ? +1 :
+	  a->namelen < b->namelen ? -1 : 0);
+}
 
-  prepare_string(len, buf, "");
+// Returns our own environment, sorted by name, in *out
+static size_t env_sorted(EnvEntry **out) {
+  const char *const *p;
+  const char *s, *eq;
+  size_t n = 0;
+
+  for (p = (void*)environ; *p; p++) n++;
+  EnvEntry *e = xmalloc((n+1) * sizeof(*e));
+  n = 0;
+  for (p = (void*)environ; (s = *p); p++) {
+    if (!(eq = strchr(s, '='))) continue;
+    e[n].s = s;
+    e[n].namelen = eq - s;
+    n++;
+  }
+  qsort(e, n, sizeof(*e), env_entry_compar);
+  *out = e;
+  return n;
+}
 
-  p = executor_argv;
-  while ((s = *p++))
-    prepare_string(len, buf, s);
+static void env_hash_hex(const EnvEntry *e, size_t n,
+			 char hex[ENVHASH_HEXLEN+1]) {
+  struct sha256_ctx sc;
+  unsigned char bbuf[SHA256_DIGEST_SIZE];
+  size_t i;
+
+  sha256_init(&sc);
+  for (i=0; i<n; i++)
+    sha256_update(&sc, strlen(e[i].s)+1, (const void*)e[i].s);
+  sha256_digest(&sc, sizeof(bbuf), bbuf);
+  for (i=0; i<sizeof(bbuf); i++)
+    sprintf(hex + i*2, "%02x", bbuf[i]);
 }
 
-static void send_fd(int payload_fd) {
-  int via_fd = fileno(call_sock);
+// Spawning client: the script has told us the hash of its baseline
+static void env_baseline_record(void) {
+  EnvEntry *e;
+  char hex[ENVHASH_HEXLEN+1];
+  size_t i, n = env_sorted(&e);
+
+  env_hash_hex(e, n, hex);
+  if (strcmp(hex, greeting_envhash)) {
+    // Not the same (or it doesn't do deltas), so none for this server
+    if (unlink(env_path) && errno != ENOENT)
+      diee("remove stale environment baseline %s", env_path);
+    goto out;
+  }
 
-  union {
-    struct cmsghdr align;
-    char buf[CMSG_SPACE(sizeof(payload_fd))];
-  } cmsg_buf;
+  char *tmp = m_asprintf("%s.tmp", env_path);
+  int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (fd < 0) diee("create environment baseline %s", tmp);
+  FILE *f = fdopen(fd, "w");
+  if (!f) diee("fdopen environment baseline %s", tmp);
+  fprintf(f, "%s\n", hex);
+  for (i=0; i<n; i++)
+    fwrite(e[i].s, strlen(e[i].s)+1, 1, f);
+  if (ferror(f) || fclose(f)) diee("write environment baseline %s", tmp);
+  if (rename(tmp, env_path)) diee("install environment baseline %s", tmp);
+  free(tmp);
+
+ out:
+  free(e);
+}
 
-  struct msghdr msg;
-  FILLZERO(msg);
-  FILLZERO(cmsg_buf);
+// Sets env_send, to a delta if we can
+static void env_prepare(void) {
+  EnvEntry *e;
+  size_t n = env_sorted(&e);
 
-  char dummy_byte = 0;
-  struct iovec iov;
-  FILLZERO(iov);
-  iov.iov_base = &dummy_byte;
-  iov.iov_len = 1;
+  env_send = e;
+  env_send_n = n;
+  env_delta_hash[0] = 0;
+  if (!env_delta_ok) return;
 
-  msg.msg_name = 0;
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = cmsg_buf.buf;
-  msg.msg_controllen = sizeof(cmsg_buf.buf);
+  int fd = open(env_path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) return;
+    diee("open environment baseline %s", env_path);
+  }
+  struct stat stab;
+  if (fstat(fd, &stab)) diee("fstat environment baseline %s", env_path);
+  if (stab.st_size <= ENVHASH_HEXLEN+1) { close(fd); return; }
+  char *base = xmalloc(stab.st_size + 1);
+  ssize_t got = read(fd, base, stab.st_size);
+  if (got != stab.st_size) diee("read environment baseline %s", env_path);
+  close(fd);
+  base[got] = 0;
+  if (base[ENVHASH_HEXLEN] != '\n' || base[got-1]) { free(base); return; }
+
+  // Merge our (sorted) environment with the (sorted) baseline
+  const char *b = base + ENVHASH_HEXLEN + 1;
+  const char *bend = base + got;
+  size_t dn = 0, i = 0, bn = 0;
+  for (const char *q = b; q < bend; q++)
+    if (!*q) bn++;
+  EnvEntry *d = xmalloc((n + bn) * sizeof(*d) + (bend - b));
+  char *removals = (char*)(d + n + bn);
+
+  while (i < n || b < bend) {
+    EnvEntry be = { 0 };
+    int c;
+    if (b < bend) {
+      const char *eq = strchr(b, '=');
+      if (!eq) { free(d); free(base); return; }
+      be.s = b;
+      be.namelen = eq - b;
+    }
+    c = i >= n ? +1 : b >= bend ? -1 : env_entry_compar(&e[i], &be);
+    if (c < 0) {
+      d[dn++] = e[i++];
+    } else if (c > 0) {
+      memcpy(removals, be.s, be.namelen);
+      removals[be.namelen] = 0;
+      d[dn].s = removals;
+      d[dn].namelen = be.namelen;
+      dn++;
+      removals += be.namelen + 1;
+    } else {
+      if (strcmp(e[i].s, be.s)) d[dn++] = e[i];
+      i++;
+    }
+    if (c >= 0) b += strlen(b) + 1;
+  }
 
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(payload_fd));
-  *(int*)CMSG_DATA(cmsg) = payload_fd;
+  // d now contains pointers into e's strings (environ) and removals
+  memcpy(env_delta_hash, base, ENVHASH_HEXLEN);
+  env_delta_hash[ENVHASH_HEXLEN] = 0;
+  free(base);
+  free(e);
+  env_send = d;
+  env_send_n = dn;
+}
 
-  msg.msg_controllen = sizeof(cmsg_buf.buf);
+static void prepare_message(size_t *len, char **buf) {
+  const char *s;
+  size_t i;
 
-  for (;;) {
-    ssize_t r = sendmsg(via_fd, &msg, 0);
-    if (r == -1) {
-      if (errno == EINTR) continue;
-      diee("send fd");
-    }
-    assert(r == 1);
-    break;
+  if (env_delta_hash[0]) {
+    prepare_data(len, buf, "=", 1);
+    prepare_string(len, buf, env_delta_hash);
   }
+  for (i=0; i<env_send_n; i++)
+    prepare_string(len, buf, env_send[i].s);
+
+  prepare_string(len, buf, "");
+
+  const char *const *p = executor_argv;
+  while ((s = *p++))
+    prepare_string(len, buf, s);
 }
 
-static void send_request(void) {
-  char ibyte= 0;
-  ssize_t sr = fwrite(&ibyte, 1, 1, call_sock);
-  if (sr != 1) diee("write signalling byte");
+// Sends the signalling byte, the fds and the message, all with one
+// syscall.  Returns false if the peer has gone away.
+static bool send_request(void) {
+  int via_fd = fileno(call_sock);
 
-  // Sending these before the big message makes it easier for the script to
-  // use buffered IO for the message.
-  send_fd(0);
-  send_fd(1);
-  send_fd(2);
+  env_prepare();
 
   size_t len = 0;
   prepare_message(&len, 0);
@@ -707,10 +1138,79 @@ static void send_request(void) {
   prepare_message(0, &p);
   assert(p == m + tlen);
 
-  sr = fwrite(m, tlen, 1, call_sock);
-  if (sr != 1) diee("write request (buffer)");
+  // Each fd goes with its own zero byte, as the script side receives
+  // them one at a time.  The big message goes last, which makes it
+  // easier for the script to use buffered IO for it.
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsg_bufs[3];
+  static char zero_bytes[4];
+  struct iovec iovs[5];
+  struct mmsghdr msgs[4];
+  FILLZERO(cmsg_bufs);
+  FILLZERO(iovs);
+  FILLZERO(msgs);
+
+  int i;
+  for (i=0; i<4; i++) {
+    iovs[i].iov_base = &zero_bytes[i];
+    iovs[i].iov_len = 1;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (!i) continue;
+
+    int payload_fd = call_fds[i-1];
+    struct msghdr *msg = &msgs[i].msg_hdr;
+    msg->msg_control = cmsg_bufs[i-1].buf;
+    msg->msg_controllen = sizeof(cmsg_bufs[i-1].buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(payload_fd));
+    *(int*)CMSG_DATA(cmsg) = payload_fd;
+  }
+  iovs[4].iov_base = m;
+  iovs[4].iov_len = tlen;
+  msgs[3].msg_hdr.msg_iovlen = 2;
+
+  struct mmsghdr *next = msgs;
+  while (next < msgs + 4) {
+    int r = sendmmsg(via_fd, next, msgs + 4 - next, MSG_NOSIGNAL);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EPIPE || errno == ECONNRESET) goto x_gone;
+      diee("send request");
+    }
+    assert(r > 0);
+    next += r;
+    if (next == msgs + 4) trace_stamp(TR_FDS);
+    // We might have been interrupted part way through the message;
+    // only the final one is long enough for that.
+    size_t done = next[-1].msg_len;
+    if (next == msgs + 4 && done < 1 + tlen) {
+      done--;
+      while (done < tlen) {
+	ssize_t sr = send(via_fd, m + done, tlen - done, MSG_NOSIGNAL);
+	if (sr == -1) {
+	  if (errno == EINTR) continue;
+	  if (errno == EPIPE || errno == ECONNRESET) goto x_gone;
+	  diee("send request (remainder)");
+	}
+	done += sr;
+      }
+    }
+  }
 
-  if (fflush(call_sock)) diee("write request");
+  trace_stamp(TR_SENT);
+  free(m);
+  free(env_send);
+  return 1;
+
+ x_gone:
+  free(m);
+  free(env_send);
+  return 0;
 }
 
 static FILE *call_sock_from_fd(int fd) {
@@ -745,6 +1245,35 @@ static void protocol_read(void *data, size_t sz) {
     die("monitor process quit unexpectedly");
 }
 
+// Reads len bytes of nul-terminated KEY=VALUE strings, calling each
+// for every one.  Any which are unreasonably long are ignored.
+static void read_items(uint32_t len, void (*each)(char *item)) {
+  char buf[256];
+  size_t used = 0;
+  while (len) {
+    size_t l = sizeof(buf) - used;
+    if (l > len) l = len;
+    protocol_read(buf + used, l);
+    len -= l;
+    used += l;
+    char *item = buf, *nul;
+    while ((nul = memchr(item, 0, buf + used - item))) {
+      each(item);
+      item = nul + 1;
+    }
+    used -= item - buf;
+    memmove(buf, item, used);
+    if (used == sizeof(buf)) used = 0;
+  }
+}
+
+// We ignore greeting items we don't understand
+static void greeting_item_cb(char *item) {
+  if (!strncmp(item, "envhash=", 8) &&
+      strlen(item + 8) == ENVHASH_HEXLEN)
+    strcpy(greeting_envhash, item + 8);
+}
+
 // Returns 0 if OK, error msg if peer was garbage.
 static const char *read_greeting(void) {
   char got_magic[sizeof(header_magic)];
@@ -759,14 +1288,83 @@ static const char *read_greeting(void) {
 
   uint32_t xdata_len;
   protocol_read(&xdata_len, sizeof(xdata_len));
-  void *xdata = xmalloc(xdata_len);
-  protocol_read(xdata, xdata_len);
+  greeting_envhash[0] = 0;
+  read_items(ntohl(xdata_len), greeting_item_cb);
 
+  trace_stamp(TR_GREETING);
   return 0;
 }
 
+static FILE *trace_line;
+static char *trace_line_buf;
+static size_t trace_line_len;
+
+static void trace_item_cb(char *item) {
+  // Server times are monotonic nanoseconds, like ours
+  char *eq = strchr(item, '=');
+  if (!eq || eq == item) return;
+  errno = 0;
+  char *ep;
+  long long ns = strtoll(eq+1, &ep, 10);
+  if (errno || ep == eq+1 || *ep) return;
+  fprintf(trace_line, " %.*s=%lld", (int)(eq - item), item,
+	  (ns - trace_ns(&trace_ts[TR_START])) / 1000);
+}
+
+// Reads any trace items after the status, and writes the trace line.
+// Problems with the trace destination are only warnings.
+static void trace_report(uint32_t status) {
+  int i;
+
+  if (!trace_dest) return;
+
+  trace_line = open_memstream(&trace_line_buf, &trace_line_len);
+  if (!trace_line) diee("open_memstream for trace");
+
+  struct timespec now;
+  if (clock_gettime(CLOCK_REALTIME, &now)) diee("clock_gettime");
+  fprintf(trace_line,
+	  "prefork-interp-trace t=%jd.%06ld ident=%s pid=%ld"
+	  " spawned=%d attempts=%d wstatus=%lu",
+	  (intmax_t)now.tv_sec, now.tv_nsec / 1000, ident, (long)getpid(),
+	  trace_spawned, trace_attempts, (unsigned long)status);
+  for (i=1; i<TR_MAX; i++) {
+    if (!trace_ts[i].tv_sec && !trace_ts[i].tv_nsec) continue;
+    fprintf(trace_line, " %s=%lld", trace_names[i],
+	    (trace_ns(&trace_ts[i]) - trace_ns(&trace_ts[TR_START])) / 1000);
+  }
+
+  // An old script side sends nothing more, so we get EOF
+  uint32_t items_len;
+  if (protocol_read_maybe(&items_len, sizeof(items_len)) >= 0)
+    read_items(ntohl(items_len), trace_item_cb);
+
+  fputc('\n', trace_line);
+  if (fclose(trace_line)) diee("write trace line to memory");
+  trace_line = 0;
+
+  if (!strcmp(trace_dest, "syslog")) {
+    openlog(our_name, LOG_PID, LOG_USER);
+    syslog(LOG_INFO, "%.*s", (int)trace_line_len - 1, trace_line_buf);
+    closelog();
+  } else {
+    int fd = open(trace_dest, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666);
+    if (fd < 0) {
+      warninge("open trace file %s", trace_dest);
+    } else {
+      // One write, so that lines from concurrent invocations don't mix
+      ssize_t wr = write(fd, trace_line_buf, trace_line_len);
+      if (wr != (ssize_t)trace_line_len)
+	warninge("write trace file %s", trace_dest);
+      close(fd);
+    }
+  }
+  free(trace_line_buf);
+}
+
 // Returns: call(client-end), or 0 to mean "is garbage"
 // find_socket_path must have been called
+// The request has been sent (without waiting for the greeting).
 static FILE *connect_existing(void) {
   int r;
   int fd = -1;
@@ -782,10 +1380,16 @@ static FILE *connect_existing(void) {
     if (errno==ECONNREFUSED || errno==ENOENT) goto x_garbage;
     diee("connect() %s", socket_path);
   }
+  trace_stamp(TR_CONNECT);
 
   call_sock = call_sock_from_fd(fd);
   fd = -1;
 
+  // If the server turns out to be garbage, the fds we sent are
+  // just discarded, and we will send them again to the next one.
+  if (!send_request())
+    goto x_garbage;
+
   if (read_greeting())
     goto x_garbage;
 
@@ -797,40 +1401,181 @@ static FILE *connect_existing(void) {
   return 0;
 }
 
-static void watcher_cb_stdin(uv_poll_t *handle, int status, int events) {
-  char c;
-  int r;
+static uv_loop_t *watcher_loop;
+static const char *warm_path;
+static bool warm_reload;
 
-  if ((errno = -status)) diee("watcher: poll stdin");
+typedef struct {
+  uv_fs_event_t uvhandle; // must be first
+  char path[];
+} WatchedFile;
+
+static bool watcher_sockpath_ours(const char *path) {
+  struct stat now_stab;
   for (;;) {
-    r= read(0, &c, 1);
-    if (r!=-1) _exit(0);
-    if (!(errno==EINTR || errno==EWOULDBLOCK || errno==EAGAIN))
-      diee("watcher: read sentinel stdin");
+    int r= stat(path, &now_stab);
+    if (!r) return stabs_same_inode(&now_stab, &initial_stab);
+    if (errno==ENOENT) return 0;
+    if (errno!=EINTR) diee("stat socket: %s", path);
   }
 }
 
-static void watcher_cb_sockpath(uv_fs_event_t *handle, const char *filename,
-				int events, int status) {
+static pid_t spawn_server(const struct sockaddr_un *sun, int lockfd,
+			  int *call_fd_r);
+static int wait_for(pid_t pid, const char *what);
+
+static void watcher_close_handle(uv_handle_t *handle, void *arg) {
+  if (!uv_is_closing(handle)) uv_close(handle, 0);
+}
+
+// Starts a fresh server at warm_path and, once it is ready, renames
+// its socket over ours.  There is no caller to show the script's
+// errors to; if this fails, our watcher does an ordinary reload, and
+// the next caller will see them.
+static __attribute__((noreturn)) void become_warm_spawner(void) {
+  int r;
+
+  int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd < 0) diee("open null");
+  for (int fd=0; fd<3; fd++)
+    if (dup2(null_fd, fd) != fd) diee("dup2 /dev/null");
+  close(null_fd);
+  // Our parent has finished with the loop, so we can tear it down,
+  // rather than pass its fds on to the new watcher.  (Just closing
+  // them all would upset libuv.)
+  uv_walk(watcher_loop, watcher_close_handle, 0);
+  uv_run(watcher_loop, UV_RUN_NOWAIT);
+  errno= -uv_loop_close(watcher_loop);
+  if (errno) diee("watcher: uv_loop_close");
+
+  // We're starting a server, so we are now the most recent, just as
+  // in connect_or_spawn
+  preclean();
+  int lockfd = acquire_lock();
+
+  // Perhaps someone has replaced it already (eg prefork-interp -f)
+  if (!watcher_sockpath_ours(socket_path)) _exit(0);
+
+  r= unlink(warm_path);
+  if (r && errno!=ENOENT) diee("remove stale socket %s", warm_path);
+
+  struct sockaddr_un sun;
+  FILLZERO(sun);
+  sun.sun_family = AF_UNIX;
+  snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", warm_path);
+
+  int call_fd;
+  pid_t setup_pid = spawn_server(&sun, lockfd, &call_fd);
+  call_sock = call_sock_from_fd(call_fd);
+
+  // The greeting shows that the script got as far as
+  // prefork_initialisation_complete.  Then, when we exit, the initial
+  // monitor sees EOF instead of a request, and just exits.
+  if (wait_for(setup_pid, "setup") ||
+      read_greeting() ||
+      rename(warm_path, socket_path)) {
+    // Its watcher will notice, and then the server will quit
+    unlink(warm_path);
+    _exit(127);
+  }
+  _exit(0);
+}
+
+static __attribute__((noreturn)) void watcher_reload(const char *path) {
+  if (warm_reload) {
+    pid_t child = fork();
+    if (child == (pid_t)-1) diee("watcher: fork for warm reload");
+    if (!child) become_warm_spawner();
+    // If it worked, the socket isn't ours now, and our server knows
+    // that as soon as we exit.
+    if (!wait_for(child, "warm reload")) _exit(0);
+  }
+  fprintf(stderr, "reload %s\n", path);
+  _exit(0);
+}
+
+// Like the script's own check, but deleted files count too, since
+// then we can no longer watch them.
+static void watcher_check_file(const char *path) {
+  struct stat stab;
+  int r= stat(path, &stab);
+  if (r==-1) {
+    if (errno==ENOENT) watcher_reload(path);
+    diee("watcher: stat %s", path);
+  }
+  if (timespeccmp(&stab.st_mtim, &initial_stab.st_mtim, >))
+    watcher_reload(path);
+}
+
+static void watcher_cb_file(uv_fs_event_t *handle, const char *filename,
+			    int events, int status) {
+  WatchedFile *wf = (WatchedFile*)handle;
+
+  if ((errno = -status)) diee("watcher: watch %s", wf->path);
+  if (events & UV_RENAME) watcher_reload(wf->path);
+  watcher_check_file(wf->path);
+}
+
+static void watcher_add_file(const char *path) {
+  struct stat stab;
+  if (stat(path, &stab) && errno==ENOENT)
+    return; // the script doesn't reload for files which don't exist
+
+  WatchedFile *wf = xmalloc(sizeof(*wf) + strlen(path) + 1);
+  strcpy(wf->path, path);
+  errno= -uv_fs_event_init(watcher_loop, &wf->uvhandle);
+  if (errno) diee("watcher: uv_fs_event_init");
+  errno= -uv_fs_event_start(&wf->uvhandle, watcher_cb_file, path, 0);
+  if (errno) {
+    fprintf(stderr, "unwatched %s\n", path);
+    return;
+  }
+
+  // It might have changed before we started watching
+  watcher_check_file(path);
+}
+
+static void watcher_cb_stdin(uv_poll_t *handle, int status, int events) {
+  static char buf[PATH_MAX + 1];
+  static size_t used;
   int r;
-  struct stat now_stab;
 
   if ((errno = -status)) diee("watcher: poll stdin");
   for (;;) {
-    r= stat(socket_path, &now_stab);
+    // Without the "watch" protocol item, this would just be a sentinel
+    r= read(0, buf + used, sizeof(buf) - used);
+    if (r==0) _exit(0);
     if (r==-1) {
-      if (errno==ENOENT) _exit(0);
       if (errno==EINTR) continue;
-      diee("stat socket: %s", socket_path);
+      if (errno==EWOULDBLOCK || errno==EAGAIN) return;
+      diee("watcher: read sentinel stdin");
     }
-    if (!stabs_same_inode(&now_stab, &initial_stab))
-      _exit(0);
+    used += r;
+    char *path = buf, *nul;
+    while ((nul = memchr(path, 0, buf + used - path))) {
+      if (*path) watcher_add_file(path);
+      else warm_reload = 1;
+      path = nul + 1;
+    }
+    used -= path - buf;
+    memmove(buf, path, used);
+    if (used == sizeof(buf)) die("watcher: over-long filename from script");
   }
 }
 
-// On entry, stderr is still inherited, but 0 and 1 are the pipes
+static void watcher_cb_sockpath(uv_fs_event_t *handle, const char *filename,
+				int events, int status) {
+  if ((errno = -status)) diee("watcher: poll stdin");
+  // During a warm reload, the new server's socket is at warm_path
+  if (!watcher_sockpath_ours(socket_path) &&
+      !watcher_sockpath_ours(warm_path))
+    _exit(0);
+}
+
+// On entry, stderr is still inherited, but 0 and 1 are the pipes.
+// sock_path is where our server's socket is now.
 static __attribute__((noreturn))
-void become_watcher(void) {
+void become_watcher(const char *sock_path) {
   uv_loop_t loop;
   uv_poll_t uvhandle_stdin;
   uv_fs_event_t uvhandle_sockpath;
@@ -840,6 +1585,7 @@ void become_watcher(void) {
 
   errno= -uv_loop_init(&loop);
   if (errno) diee("watcher: uv_loop_init");
+  watcher_loop = &loop;
 
   errno= -uv_poll_init(&loop, &uvhandle_stdin, 0);
   if (errno) diee("watcher: uv_poll_init");
@@ -852,7 +1598,7 @@ void become_watcher(void) {
   if (errno) diee("watcher: uv_fs_event_init");
 
   errno= -uv_fs_event_start(&uvhandle_sockpath, watcher_cb_sockpath,
-			    socket_path, 0);
+			    sock_path, 0);
   if (errno) diee("watcher: uv_fs_event_start");
 
   // OK everything is set up, let us daemonise
@@ -888,10 +1634,10 @@ void become_setup(int sfd, int lockfd, int fake_pair[2],
   //
   // We could advertise a new protocol (perhaps one which is nearly entirely
   // different after the connect) by putting a name for it comma-separated
-  // next to "v1".  Simple extension can be done by having the script
-  // side say something about it in the ack xdata, which we currently ignore.
-  // Or we could add other extra data after v1.
-  putenv(m_asprintf("PREFORK_INTERP=v1,%jd.%09ld %d,%d,%d,%d",
+  // after the timestamp, as we do for "v2".  Simple extension can be done
+  // by having the script side say something about it in the ack xdata,
+  // which we currently ignore.
+  putenv(m_asprintf("PREFORK_INTERP=v1,%jd.%09ld,v2,watch %d,%d,%d,%d",
                     (intmax_t)initial_stab.st_mtim.tv_sec,
                     (long)initial_stab.st_mtim.tv_nsec,
 		    sfd, call_fd, watcher_stdin, watcher_stderr));
@@ -900,43 +1646,31 @@ void become_setup(int sfd, int lockfd, int fake_pair[2],
   diee("execute %s", executor_argv[0]);
 }
 
-static void connect_or_spawn(void) {
-  int r;
-
-  call_sock = connect_existing();
-  if (call_sock) return;
-
-  // We're going to make a new one, so clean out old ones
-  preclean();
-
-  int lockfd = acquire_lock();
-
-  if (mode == MODE_KILL) {
-    r= unlink(socket_path);
-    if (r && errno != ENOENT) diee("remove socket %s", socket_path);
-
-    r= unlink(lock_path);
-    if (r) diee("rmeove lock %s", lock_path);
-    _exit(0);
-  }
-
-  call_sock = connect_existing();
-  if (call_sock) { close(lockfd); return; }
-
-  // We must start a fresh one, and we hold the lock
+static int wait_for(pid_t pid, const char *what) {
+  int status;
+  pid_t got = waitpid(pid, &status, 0);
+  if (got == (pid_t)-1) diee("waitpid %s [%ld]", what, (long)pid);
+  if (got != pid) diee("waitpid %s [%ld] gave [%ld]!",
+		       what, (long)pid, (long)got);
+  return status;
+}
 
-  r = unlink(socket_path);
-  if (r<0 && errno!=ENOENT)
-    diee("failed to remove stale socket %s", socket_path);
+// We hold the lock, and sun's path does not exist.  Starts a fresh
+// server listening there, and returns the pid of its setup process,
+// which exits when the server is ready, and the fd for its initial
+// call.
+static pid_t spawn_server(const struct sockaddr_un *sun, int lockfd,
+			  int *call_fd_r) {
+  int r;
 
   int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
   if (sfd<0) diee("socket() for new listener");
 
-  socklen_t salen = sizeof(sockaddr_sun);
-  r= bind(sfd, (const struct sockaddr*)&sockaddr_sun, salen);
+  socklen_t salen = sizeof(*sun);
+  r= bind(sfd, (const struct sockaddr*)sun, salen);
   if (r<0) diee("bind() on new listener");
 
-  r= stat(socket_path, &initial_stab);
+  r= stat(sun->sun_path, &initial_stab);
   if (r<0) diee("stat() fresh socket");
 
   // We never want callers to get ECONNREFUSED.  But:
@@ -965,7 +1699,7 @@ static void connect_or_spawn(void) {
       diee("initial dup2() for watcher");
     close(watcher_stdin[0]);
     close(watcher_stderr[1]);
-    become_watcher();
+    become_watcher(sun->sun_path);
   }
 
   close(watcher_stdin[0]);
@@ -985,18 +1719,60 @@ static void connect_or_spawn(void) {
   close(fake_pair[1]);
   close(sfd);
 
-  call_sock = call_sock_from_fd(fake_pair[0]);
+  *call_fd_r = fake_pair[0];
+  return setup_pid;
+}
 
-  int status;
-  pid_t got = waitpid(setup_pid, &status, 0);
-  if (got == (pid_t)-1) diee("waitpid setup [%ld]", (long)setup_pid);
-  if (got != setup_pid) diee("waitpid setup [%ld] gave [%ld]!",
-			     (long)setup_pid, (long)got);
+static void connect_or_spawn(void) {
+  int r;
+
+  call_sock = connect_existing();
+  if (call_sock) return;
+
+  // We're going to make a new one, so clean out old ones
+  preclean();
+
+  int lockfd = acquire_lock();
+
+  if (mode == MODE_KILL) {
+    r= unlink(socket_path);
+    if (r && errno != ENOENT) diee("remove socket %s", socket_path);
+
+    r= unlink(env_path);
+    if (r && errno != ENOENT) diee("remove environment %s", env_path);
+
+    r= unlink(lock_path);
+    if (r) diee("rmeove lock %s", lock_path);
+    _exit(0);
+  }
+
+  call_sock = connect_existing();
+  if (call_sock) { close(lockfd); return; }
+
+  // We must start a fresh one, and we hold the lock
+
+  r = unlink(socket_path);
+  if (r<0 && errno!=ENOENT)
+    diee("failed to remove stale socket %s", socket_path);
+
+  int call_fd;
+  pid_t setup_pid = spawn_server(&sockaddr_sun, lockfd, &call_fd);
+  call_sock = call_sock_from_fd(call_fd);
+
+  int status = wait_for(setup_pid, "setup");
   if (status != 0) propagate_exit_status(status, "setup");
+  trace_stamp(TR_CONNECT);
+  trace_spawned = 1;
+
+  // The new server's baseline is our environment, so no delta
+  env_delta_ok = 0;
+  if (!send_request()) die("setup failed: initial monitor process quit");
 
   const char *emsg = read_greeting();
   if (emsg) die("setup failed: %s", emsg);
 
+  env_baseline_record();
+
   close(lockfd);
   return;
 }
@@ -1026,6 +1802,97 @@ static void make_executor_argv(const char *const *argv) {
   *out++ = 0;
 }
 
+// Returns the wait status.  If call_sock is open, the monitor has
+// offered to take another call on it (see part 4 step 17), so we
+// try that first.
+static uint32_t make_call(void) {
+  uint32_t status;
+  for (;;) {
+    // We're committed once the request is sent
+    trace_attempts++;
+    if (!(call_sock && send_request())) {
+      if (call_sock) { fclose(call_sock); call_sock = 0; }
+      connect_or_spawn();
+    }
+
+    protocol_read(&status, sizeof(status));
+    status = ntohl(status);
+    trace_stamp(TR_STATUS);
+    if (status != STATUS_RESEND_FULL_ENV) break;
+
+    // Server had a different baseline environment from the one we used
+    if (!env_delta_hash[0]) die("server asked for full environment again");
+    env_delta_ok = 0;
+    fclose(call_sock);
+    call_sock = 0;
+  }
+  if (status > INT_MAX) die("status 0x%lx does not fit in an int",
+			    (unsigned long)status);
+  return status;
+}
+
+static __attribute__((noreturn)) void batch_calls(void) {
+  size_t base = 0, n, alloc;
+  bool eof = 0, failed = 0;
+
+  while (executor_argv[base]) base++;
+  alloc = base + 16;
+  const char **args = xmalloc(alloc * sizeof(*args));
+  memcpy(args, executor_argv, base * sizeof(*args));
+
+  // Our stdin is the argument vectors, so the calls get /dev/null
+  int null_fd = open("/dev/null", O_RDONLY);
+  if (null_fd < 0) diee("open /dev/null");
+  call_fds[0] = null_fd;
+
+  for (;;) {
+    for (n = base; ; ) {
+      char *arg = 0;
+      size_t arg_sz = 0;
+      ssize_t l = getdelim(&arg, &arg_sz, 0, stdin);
+      if (l < 0) {
+	if (ferror(stdin)) diee("read argument vectors from stdin");
+	free(arg);
+	eof = 1;
+	break;
+      }
+      if (l && !arg[l-1]) l--; // the last one may lack its nul
+      if (!l) { free(arg); break; }
+      if (n+1 >= alloc) {
+	alloc *= 2;
+	args = realloc(args, alloc * sizeof(*args));
+	if (!args) diee("allocate for arguments");
+      }
+      args[n++] = arg;
+    }
+    if (eof && n == base) break;
+    args[n] = 0;
+    executor_argv = args;
+
+    trace_restart();
+    uint32_t status = make_call();
+    trace_report(status);
+
+    // The monitor may offer to take another call
+    if (read_greeting()) { fclose(call_sock); call_sock = 0; }
+
+    printf("%d\n",
+	   WIFEXITED(status) ? WEXITSTATUS(status) :
+	   WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 255);
+    if (fflush(stdout)) diee("write status to stdout");
+    if (status) failed = 1;
+
+    while (n > base) free((char*)args[--n]);
+    if (eof) break;
+
+    // Later reconnections should use the fresh server
+    if (mode == MODE_FRESH) mode = MODE_NORMAL;
+  }
+
+  if (call_sock) fclose(call_sock);
+  exit(failed);
+}
+
 int main(int argc_unused, const char *const *argv) {
   process_opts(&argv);
 
@@ -1035,6 +1902,7 @@ int main(int argc_unused, const char *const *argv) {
   //  - remaining args
   // which ought to be passed on to the actual executor.
   make_executor_argv(argv);
+  trace_init();
 
   find_socket_path();
   FILLZERO(sockaddr_sun);
@@ -1042,17 +1910,17 @@ int main(int argc_unused, const char *const *argv) {
   assert(strlen(socket_path) <= sizeof(sockaddr_sun.sun_path));
   strncpy(sockaddr_sun.sun_path, socket_path, sizeof(sockaddr_sun.sun_path));
 
-  connect_or_spawn();
-
-  // We're committed now, send the request (or bail out)
-  send_request();
+  env_path = m_asprintf("%s/e%s", run_base, ident);
+  warm_path = m_asprintf("%s/n%s", run_base, ident);
+  index_path = m_asprintf("%s/index", run_base);
 
-  uint32_t status;
-  protocol_read(&status, sizeof(status));
+  if (batch) {
+    if (mode == MODE_KILL) badusage("--batch makes no sense with --kill");
+    batch_calls();
+  }
 
-  status = ntohl(status);
-  if (status > INT_MAX) die("status 0x%lx does not fit in an int",
-			    (unsigned long)status);
+  uint32_t status = make_call();
+  trace_report(status);
 
   propagate_exit_status(status, "invocation");
 }
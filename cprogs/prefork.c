@@ -195,8 +195,8 @@ void find_socket_path(void) {
   socket_path = m_asprintf("%s/s%s",run_base,ident);
 }  
 
-// Returns fd
-int flock_file(const char *lock_path) {
+// Returns fd, or -1 if LOCK_NB and someone else has it
+static int flock_file_op(const char *lock_path, int op) {
   int r;
   int lockfd = -1;
   struct stat stab_fd;
@@ -208,8 +208,9 @@ int flock_file(const char *lock_path) {
     lockfd = open(lock_path, O_CREAT|O_RDWR, 0600);
     if (lockfd<0) diee("create lock (%s)", lock_path);
 
-    r = flock(lockfd, LOCK_EX);
+    r = flock(lockfd, op);
     if (r && errno == EINTR) continue;
+    if (r && errno == EWOULDBLOCK) { close(lockfd); return -1; }
     if (r) diee("lock lock (%s)", lock_path);
 
     r = fstat(lockfd, &stab_fd);
@@ -226,6 +227,16 @@ int flock_file(const char *lock_path) {
   return lockfd;
 }
 
+// Returns fd
+int flock_file(const char *lock_path) {
+  return flock_file_op(lock_path, LOCK_EX);
+}
+
+// Returns fd, or -1 if someone else has it
+int flock_file_try(const char *lock_path) {
+  return flock_file_op(lock_path, LOCK_EX|LOCK_NB);
+}
+
 // Returns fd
 int acquire_lock(void) {
   lock_path = m_asprintf("%s/l%s",run_base,ident);
@@ -50,6 +50,7 @@ void find_socket_path(void);
 
 int acquire_lock(void);
 int flock_file(const char *lock_path);
+int flock_file_try(const char *lock_path);
 
 extern const struct cmdinfo cmdinfos[];
 #define PREFORK_CMDINFOS \
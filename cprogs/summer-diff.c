@@ -0,0 +1,259 @@
+/*
+ * summer-diff - compare two binary manifests written by summer -m
+ *
+ * usage:
+ *    summer-diff [-ACMq] [-i field] [-p path] old.bin new.bin
+ *
+ * Prints one line per differing entry:
+ *    - path                 only in old
+ *    + path                 only in new
+ *    ~ path field,field...  in both, but those fields differ
+ * Exits 0 if the manifests are the same, 1 if they differ.
+ *
+ * Both manifests are read once, front to back, so memory use does
+ * not depend on their size.  They must each be in summer's visiting
+ * order, which is the case unless several startpoints were given
+ * out of order.
+ */
+/*
+ * Copyright (C) 2026 contributors to chiark-utils
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3,
+ * or (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this file; if not, consult the Free Software
+ * Foundation's website at www.fsf.org, or the GNU Project website at
+ * www.gnu.org.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "manifest.h"
+
+static int quiet=0, ndiffs=0;
+static int ignore[MFT_MAX];
+static const char *prefix;
+static size_t prefixl;
+
+struct side {
+  struct mf_reader r;
+  struct mf_tree t;
+  int tree; /* t is usable */
+  int have; /* r.fields describes a current record */
+  char *last;  size_t lastl, lastallocd;
+};
+
+static void malloc_fail(void) { perror("summer-diff: alloc failed"); exit(12); }
+
+void *mf_malloc(size_t sz) {
+  void *r= malloc(sz);  if (!r) malloc_fail();
+  return r;
+}
+
+void *mf_realloc(void *p, size_t sz) {
+  void *r= realloc(p,sz);  if (!r && sz) malloc_fail();
+  return r;
+}
+
+void mf_corrupt(const char *name, const char *what) {
+  fprintf(stderr,"summer-diff: %s: %s\n", name, what);
+  exit(12);
+}
+
+static void badusage(void) {
+  fprintf(stderr,"summer-diff: bad usage, try -h\n");
+  exit(8);
+}
+
+static void fn_escaped(const unsigned char *p, size_t l) {
+  int c;
+  while (l--) {
+    c= *p++;
+    if (c>=33 && c<=126 && c!='\\') putchar(c);
+    else printf("\\x%02x",c);
+  }
+}
+
+/* <0: before the -p subtree; 0: in it; >0: after it */
+static int region(const struct mf_field *pf) {
+  const char *p= (const char*)pf->p;
+  int c;
+
+  if (!prefix) return 0;
+  if (pf->l >= prefixl && !memcmp(p,prefix,prefixl) &&
+      (pf->l==prefixl || prefix[prefixl-1]=='/' || p[prefixl]=='/'))
+    return 0;
+  c= mf_pathcmp(p,pf->l, prefix,prefixl);
+  return c<0 ? -1 : 1;
+}
+
+static void advance(struct side *s) {
+  const struct mf_field *pf;
+  int rg;
+
+  for (;;) {
+    s->have= mf_read(&s->r);
+    if (!s->have) return;
+    pf= &s->r.fields[MFT_PATH];
+
+    if (s->lastl &&
+	mf_pathcmp(s->last,s->lastl, (const char*)pf->p,pf->l) >= 0)
+      mf_corrupt(s->r.name, "records out of order (unsorted startpoints?)");
+    if (pf->l > s->lastallocd) {
+      s->lastallocd= pf->l*2;
+      s->last= mf_realloc(s->last, s->lastallocd);
+    }
+    memcpy(s->last, pf->p, pf->l);
+    s->lastl= pf->l;
+
+    rg= region(pf);
+    if (!rg) return;
+    if (rg>0) { s->have= 0; return; }
+  }
+}
+
+static void report(int c, const struct mf_field *pf) {
+  ndiffs++;
+  if (quiet) return;
+  printf("%c ",c);
+  fn_escaped(pf->p, pf->l);
+}
+
+static void compare(const struct side *a, const struct side *b) {
+  const struct mf_field *fa, *fb;
+  int tag, ndiff=0;
+
+  for (tag=MFT_PATH+1; tag<MFT_MAX; tag++) {
+    if (ignore[tag]) continue;
+    fa= &a->r.fields[tag];
+    fb= &b->r.fields[tag];
+    if (!fa->present && !fb->present) continue;
+    if (fa->present == fb->present && fa->l == fb->l &&
+	!memcmp(fa->p, fb->p, fa->l))
+      continue;
+    if (!ndiff++) report('~', &a->r.fields[MFT_PATH]);
+    if (!quiet) printf("%c%s", ndiff>1 ? ',' : ' ', mf_tagnames[tag]);
+  }
+  if (ndiff && !quiet) putchar('\n');
+}
+
+/* If the contents of this directory are the same on both sides,
+ * according to their tree hashes, skip over them.  Tree hashes leave
+ * out atimes, so we can do this only if we are not comparing those,
+ * or the manifests don't have them (summer -A). */
+static void skipsame(struct side *a, struct side *b) {
+  if (!a->tree || !b->tree || a->r.off<0 || b->r.off<0) return;
+  if (!ignore[MFT_ATIME] &&
+      (a->r.fields[MFT_ATIME].present || b->r.fields[MFT_ATIME].present))
+    return;
+  if (!mf_tree_find(&a->t, a->r.off) || !mf_tree_find(&b->t, b->r.off))
+    return;
+  if (memcmp(a->t.cur.hash, b->t.cur.hash, 16)) return;
+  if (fseeko(a->r.f, a->t.cur.end, SEEK_SET) ||
+      fseeko(b->r.f, b->t.cur.end, SEEK_SET))
+    mf_corrupt(a->r.name, "cannot seek past subtree");
+}
+
+static void openside(struct side *s, const char *name) {
+  FILE *f;
+
+  memset(s,0,sizeof(*s));
+  f= fopen(name,"rb");
+  if (!f) { fprintf(stderr,"summer-diff: %s: %s\n",name,strerror(errno));
+	    exit(12); }
+  mf_open(&s->r, f, name);
+  if (prefix && mf_seek(&s->r, prefix, prefixl) < 0)
+    mf_corrupt(name, "not sorted, so cannot use -p");
+  s->tree= mf_tree_open(&s->t, name);
+  advance(s);
+}
+
+static int ignorefield(const char *name) {
+  int tag;
+  for (tag=MFT_PATH+1; tag<MFT_MAX; tag++)
+    if (!strcmp(mf_tagnames[tag], name)) { ignore[tag]= 1; return 1; }
+  return 0;
+}
+
+int main(int argc, const char *const *argv) {
+  static char outbuf[65536];
+  struct side a, b;
+  const char *arg;
+  int c, cmp;
+
+  while ((arg=argv[1]) && *arg++=='-') {
+    while ((c=*arg++)) {
+      switch (c) {
+      case 'h':
+	fprintf(stderr,
+		"summer-diff: usage: summer-diff [-ACMq] [-i field]"
+		" [-p path] old.bin new.bin\n");
+	exit(8);
+      case 'q': quiet= 1; break;
+      case 'A': ignore[MFT_ATIME]= 1; break;
+      case 'C': ignore[MFT_CTIME]= 1; break;
+      case 'M': ignore[MFT_MTIME]= 1; break;
+      case 'i':
+      case 'p':
+	if (!*arg) { if (!(arg= argv[2])) badusage(); argv++; }
+	if (c=='p') {
+	  prefix= arg;
+	  prefixl= strlen(prefix);
+	  while (prefixl>1 && prefix[prefixl-1]=='/') prefixl--;
+	} else if (!ignorefield(arg)) {
+	  fprintf(stderr,"summer-diff: unknown field `%s'\n",arg);
+	  exit(8);
+	}
+	arg= "";
+	break;
+      default:
+	badusage();
+      }
+    }
+    argv++;
+  }
+  if (!argv[1] || !argv[2] || argv[3]) badusage();
+
+  setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+  openside(&a, argv[1]);
+  openside(&b, argv[2]);
+
+  while (a.have || b.have) {
+    cmp= !a.have ? 1 : !b.have ? -1 :
+      mf_pathcmp((const char*)a.r.fields[MFT_PATH].p, a.r.fields[MFT_PATH].l,
+		 (const char*)b.r.fields[MFT_PATH].p, b.r.fields[MFT_PATH].l);
+    if (cmp<0) {
+      report('-', &a.r.fields[MFT_PATH]);
+      if (!quiet) putchar('\n');
+      advance(&a);
+    } else if (cmp>0) {
+      report('+', &b.r.fields[MFT_PATH]);
+      if (!quiet) putchar('\n');
+      advance(&b);
+    } else {
+      compare(&a,&b);
+      skipsame(&a,&b);
+      advance(&a);
+      advance(&b);
+    }
+    if (ferror(stdout)) { perror("summer-diff: stdout"); exit(12); }
+  }
+
+  if (ferror(stdout) || fclose(stdout)) {
+    perror("summer-diff: stdout (at end)"); exit(12);
+  }
+  return !!ndiffs;
+}
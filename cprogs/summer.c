@@ -27,10 +27,16 @@
 
 #define _GNU_SOURCE
 
-#include <search.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -39,327 +45,2179 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <assert.h>
+#include <fnmatch.h>
+#include <regex.h>
 #include <stdlib.h>
 
+#include <pthread.h>
+
 #include "nettle/md5-compat.h"
+#include "nettle/nettle-meta.h"
+
+#include "manifest.h"
+
+#define MAXFN 2048
+#define CSUMXL 32 /* minimum width of first column */
+#define OUTBUFSZ (1024*1024)
+#define READBUFSZ (1024*1024)
+#define READBUFALIGN 4096
+#define ARENACHUNK 65536
+#define CHUNKMIN (16*1024)
+#define CHUNKMAX (256*1024)
+#define CHUNKMASK 0xffff000000000000ULL /* 64KiB after CHUNKMIN, on average */
+
+static int quiet=0, hidectime=0, hideatime=0, hidemtime=0;
+static int hidedirsize=0, hidelinkmtime=0, hidextime=0, onefilesystem=0;
+static int directio=0, dropcache=0, treehash=0, showalloc=0, njobs=0;
+static int profiling=0, showexcluded=0, showbtime=0, nsectimes=0;
+static int timewidth=10, usestatx=1, statxsync=AT_STATX_SYNC_AS_STAT;
+static unsigned statxmask;
+static int csumxl=CSUMXL, hashxl=0, hashcolsdone;
+static int filenamefieldsep=' ';
+static FILE *errfile, *binout, *chunkout;
+static off_t chunkthreshold= 16*1024*1024;
+static const char *watchout; /* -w: we are a daemon; see "Watching" */
+static int watchinterval;
+static struct mf_writer binw;
+static char *binproblems;
+static size_t binproblems_len;
+
+struct treehash {
+  /* a directory whose contents we are in the middle of */
+  MD5_CTX mc;
+  uint64_t start;
+};
+static struct treehash *treestack;
+static int treedepth, treeallocd;
+
+#define nodeflag_fsvalid       1u
+
+static void malloc_fail(void) { perror("summer: alloc failed"); exit(12); }
+
+static void *mmalloc(size_t sz) {
+  void *r;
+  r= malloc(sz);  if (!r) malloc_fail();
+  return r;
+}
+
+static void *mrealloc(void *p, size_t sz) {
+  void *r;
+  r= realloc(p, sz);  if (!r && sz) malloc_fail();
+  return r;
+}
+
+void *mf_malloc(size_t sz) { return mmalloc(sz); }
+void *mf_realloc(void *p, size_t sz) { return mrealloc(p,sz); }
+void mf_corrupt(const char *name, const char *what) {
+  fprintf(stderr,"summer: %s: %s\n",name,what);
+  exit(12);
+}
+
+static void fn_escaped(FILE *f, const char *fn) {
+  int c;
+  while ((c= *fn++)) {
+    if (c>=33 && c<=126 && c!='\\') putc(c,f);
+    else fprintf(f,"\\x%02x",(int)(unsigned char)c);
+  }
+}
+
+/*
+ * Profiling (-P).  We add up the time spent in each phase, and
+ * remember the directories whose entries took longest (including
+ * reading any subdirectories), with how that time was split between
+ * the phases and how much they checksummed, and the slowest files to
+ * checksum.
+ */
+
+#define PROFTOP 10
+
+enum { PH_STAT, PH_READDIR, PH_HASH, PH_OUTPUT, PH_MAX };
+static const char *const prof_phasenames[PH_MAX]=
+  { "stat", "readdir", "hash", "output" };
+static const char *const prof_countnames[PH_MAX]=
+  { "objects", "directories", "files", "lines" };
+
+static struct { double secs; uint64_t count, bytes; } prof_phases[PH_MAX];
+struct proftop {
+  double secs, phsecs[PH_MAX]; /* phsecs for directories only */
+  uint64_t bytes;
+  char *path;
+};
+static struct proftop prof_dirs[PROFTOP], prof_files[PROFTOP];
+static double prof_t0;
+static volatile sig_atomic_t prof_sigreport;
+
+static double prof_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void prof_add(int phase, double t0, uint64_t bytes) {
+  prof_phases[phase].secs += prof_now() - t0;
+  prof_phases[phase].count++;
+  prof_phases[phase].bytes += bytes;
+}
+
+/* path need only be valid for the duration of the call */
+static void prof_top(struct proftop *top, double secs, const double *phsecs,
+		     uint64_t bytes, const char *path, size_t pathl) {
+  int i;
+
+  if (secs <= top[PROFTOP-1].secs) return;
+  free(top[PROFTOP-1].path);
+  for (i=PROFTOP-1; i>0 && top[i-1].secs < secs; i--)
+    top[i]= top[i-1];
+  top[i].secs= secs;
+  if (phsecs) memcpy(top[i].phsecs, phsecs, sizeof(top[i].phsecs));
+  top[i].bytes= bytes;
+  top[i].path= mmalloc(pathl+1);
+  memcpy(top[i].path, path, pathl);
+  top[i].path[pathl]= 0;
+}
+
+static void prof_report(void) {
+  const struct proftop *top;
+  double total=0;
+  int i, ph;
+
+  fprintf(stderr,"summer: profile: %.3fs elapsed\n", prof_now() - prof_t0);
+  for (ph=0; ph<PH_MAX; ph++) {
+    total += prof_phases[ph].secs;
+    fprintf(stderr,"summer: profile: %-8s %10.3fs %12"PRIu64" %s",
+	    prof_phasenames[ph], prof_phases[ph].secs,
+	    prof_phases[ph].count, prof_countnames[ph]);
+    if (ph==PH_HASH)
+      fprintf(stderr," %15"PRIu64" bytes %9.1f MB/s",
+	      prof_phases[ph].bytes,
+	      prof_phases[ph].secs ?
+	      prof_phases[ph].bytes / 1048576.0 / prof_phases[ph].secs : 0);
+    fputc('\n',stderr);
+  }
+  fprintf(stderr,"summer: profile: %-8s %10.3fs\n", "other",
+	  prof_now() - prof_t0 - total);
+
+  for (i=0; i<2; i++) {
+    top= i ? prof_files : prof_dirs;
+    if (!top[0].path) continue;
+    fprintf(stderr,"summer: profile: slowest %s:\n",
+	    i ? "files to checksum" : "directories");
+    for (; top < (i ? prof_files : prof_dirs) + PROFTOP && top->path; top++) {
+      fprintf(stderr,"summer: profile: %10.3fs %15"PRIu64" ",
+	      top->secs, top->bytes);
+      if (!i)
+	for (ph=0; ph<PH_MAX; ph++)
+	  fprintf(stderr,"%s %.3fs ", prof_phasenames[ph], top->phsecs[ph]);
+      fn_escaped(stderr, top->path);
+      fputc('\n',stderr);
+    }
+  }
+  if (ferror(stderr)) exit(12);
+}
+
+static void prof_signal(int sig) { prof_sigreport= 1; }
+
+/*
+ * Each line of output is built up in lb and then written in one go.
+ * This is much faster than stdio's formatted output, which used to
+ * dominate runs where few files need checksumming.
+ */
+
+static char *lb;
+static size_t lbl, lb_allocd;
+static int notext; /* -m -: the binary manifest replaces the text */
+static const char hexdigits[]= "0123456789abcdef";
+
+static void lb_need(size_t n) {
+  if (lbl+n <= lb_allocd) return;
+  lb_allocd= (lbl+n)*2;
+  lb= mrealloc(lb, lb_allocd);
+}
+
+static void lb_char(int c) {
+  if (notext) return;
+  lb_need(1);
+  lb[lbl++]= c;
+}
+
+static void lb_spaces(int n) {
+  if (notext || n<=0) return;
+  lb_need(n);
+  memset(lb+lbl, ' ', n);
+  lbl += n;
+}
+
+static void lb_str(const char *s) {
+  size_t l;
+  if (notext) return;
+  l= strlen(s);
+  lb_need(l);
+  memcpy(lb+lbl, s, l);
+  lbl += l;
+}
+
+/* " %<width>s" */
+static void lb_field(const char *s, int width) {
+  if (notext) return;
+  lb_char(' ');
+  lb_spaces(width - (int)strlen(s));
+  lb_str(s);
+}
+
+/* " %<width>llu" or " %<width>o" */
+static void lb_num(uint64_t v, int base, int width) {
+  char tmp[24];
+  int n=0;
+
+  if (notext) return;
+  do { tmp[n++]= hexdigits[v % base];  v /= base; } while (v);
+  lb_char(' ');
+  lb_spaces(width-n);
+  lb_need(n);
+  while (n) lb[lbl++]= tmp[--n];
+}
+
+static void lb_hex(const unsigned char *p, size_t l) {
+  if (notext) return;
+  lb_need(l*2);
+  while (l--) {
+    lb[lbl++]= hexdigits[*p >> 4];
+    lb[lbl++]= hexdigits[*p++ & 0x0f];
+  }
+}
+
+static void lb_escaped(const char *fn) {
+  static unsigned char literal[256];
+  const unsigned char *p= (const unsigned char*)fn, *run;
+  int c;
+
+  if (notext) return;
+  if (!literal['a'])
+    for (c=33; c<=126; c++) literal[c]= c!='\\';
+
+  for (;;) {
+    for (run=p; literal[*p]; p++);
+    if (p>run) {
+      lb_need(p-run);
+      memcpy(lb+lbl, run, p-run);
+      lbl += p-run;
+    }
+    if (!*p) return;
+    lb_need(4);
+    lb[lbl++]= '\\';
+    lb[lbl++]= 'x';
+    lb[lbl++]= hexdigits[*p >> 4];
+    lb[lbl++]= hexdigits[*p++ & 0x0f];
+  }
+}
+
+static void lb_printf(const char *fmt, ...) {
+  va_list al;
+  int r;
+
+  if (notext) return;
+  va_start(al,fmt);  r= vsnprintf(0,0,fmt,al);  va_end(al);
+  lb_need(r+1);
+  va_start(al,fmt);  vsnprintf(lb+lbl,r+1,fmt,al);  va_end(al);
+  lbl += r;
+}
+
+static char *linecap; /* with -w, copy of the lines for this node */
+static size_t linecap_len, linecap_allocd;
+
+static void lb_endline(void) {
+  double t0=0;
+
+  if (notext) return;
+  if (profiling) t0= prof_now();
+  lb_char('\n');
+  fwrite(lb,1,lbl,stdout);
+  if (profiling) prof_add(PH_OUTPUT, t0, lbl);
+  if (watchout) {
+    if (linecap_len+lbl > linecap_allocd) {
+      linecap_allocd= (linecap_len+lbl)*2;
+      linecap= mrealloc(linecap, linecap_allocd);
+    }
+    memcpy(linecap+linecap_len, lb, lbl);
+    linecap_len += lbl;
+  }
+  lbl= 0;
+}
+
+static char *m_vasprintf(const char *fmt, va_list al) {
+  char *s;
+  if (vasprintf(&s,fmt,al) < 0) malloc_fail();
+  return s;
+}
+
+static void binproblem(const char *m, const char *err) {
+  size_t want= binproblems_len + strlen(m) + (err ? strlen(err) : 0) + 5;
+  binproblems= mrealloc(binproblems, want);
+  binproblems_len += sprintf(binproblems + binproblems_len, "%s%s%s%s",
+			     binproblems_len ? "; " : "",
+			     m, err ? ": " : "", err ? err : "");
+}
+
+static void tree_update(void *ctx, const unsigned char *p, size_t l) {
+  MD5Update(ctx, p, l);
+}
+
+static void bin_rec_end(const char *path) {
+  const char *base;
+
+  if (binproblems_len) {
+    mf_put_bytes(&binw, MFT_PROBLEM, binproblems, binproblems_len);
+    binproblems_len= 0;
+  }
+  if (treedepth) {
+    base= strrchr(path,'/');
+    base= base ? base+1 : path;
+    MD5Update(&treestack[treedepth-1].mc, base, strlen(base)+1);
+    mf_rec_rest(&binw, tree_update, &treestack[treedepth-1].mc);
+  }
+  mf_rec_end(&binw);
+  if (ferror(binout)) { perror("summer: manifest"); exit(12); }
+}
+
+static void tree_push(uint64_t start) {
+  if (treedepth >= treeallocd) {
+    treeallocd= treeallocd ? treeallocd*2 : 64;
+    treestack= mrealloc(treestack, sizeof(*treestack) * treeallocd);
+  }
+  MD5Init(&treestack[treedepth].mc);
+  treestack[treedepth].start= start;
+  treedepth++;
+}
+
+static void tree_pop(void) {
+  unsigned char hash[16];
+
+  treedepth--;
+  MD5Final(hash, &treestack[treedepth].mc);
+  mf_put_tree(&binw, treestack[treedepth].start, hash);
+  if (treedepth) MD5Update(&treestack[treedepth-1].mc, hash, sizeof(hash));
+}
+
+static void vproblemx(const char *path, int padto, int per,
+		      const char *fmt, va_list al) {
+  int e=errno;
+  size_t start;
+  char *m;
+
+  m= m_vasprintf(fmt,al);
+  if (binout && errfile!=stderr) binproblem(m, per ? strerror(e) : 0);
+
+  if (errfile==stderr) {
+    fprintf(stderr,"summer: error: %s",m);
+    if (per) fprintf(stderr,": %s",strerror(e));
+    fputs(": ",stderr);
+    fn_escaped(stderr,path);
+    fputc('\n',stderr);
+    /* as much of the line as we had, as printf used to leave it */
+    fwrite(lb,1,lbl,stdout);
+    exit(2);
+  }
+
+  start= lbl;
+  lb_str("\\[");
+  lb_str(m);
+  if (per) { lb_str(": "); lb_str(strerror(e)); }
+  lb_char(']');
+  free(m);
+
+  lb_spaces(padto - (int)(lbl-start));
+}
+
+static void problem_e(const char *path, int padto, const char *fmt, ...) {
+  va_list(al);
+  va_start(al,fmt);
+  vproblemx(path,padto,1,fmt,al);
+  va_end(al);
+}
+
+static void problem(const char *path, int padto, const char *fmt, ...) {
+  va_list(al);
+  va_start(al,fmt);
+  vproblemx(path,padto,0,fmt,al);
+  va_end(al);
+}
+
+static unsigned char *readbuf(void) {
+  static unsigned char *db;
+  void *p;
+  int e;
+
+  if (!db) {
+    /* aligned so that it is also usable for O_DIRECT */
+    e= posix_memalign(&p, READBUFALIGN, READBUFSZ);
+    if (e) { errno= e; malloc_fail(); }
+    db= p;
+  }
+  return db;
+}
+
+/*
+ * Content-defined chunking, for -k.  Boundaries are chosen with a
+ * gear hash, so that they depend only on the preceding 64 bytes and
+ * stay put when data is inserted or removed elsewhere in the file.
+ */
+
+struct chunker {
+  MD5_CTX mc;
+  uint64_t h, start, pos;
+};
+
+static uint64_t gear[256];
+
+static void chunk_setup(void) {
+  uint64_t x=0, z;
+  int i;
+
+  /* splitmix64, so that the table is the same everywhere */
+  for (i=0; i<256; i++) {
+    z= (x += 0x9e3779b97f4a7c15ULL);
+    z= (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z= (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i]= z ^ (z >> 31);
+  }
+}
+
+static void chunk_start(struct chunker *ck, const char *path) {
+  MD5Init(&ck->mc);
+  ck->h= ck->start= ck->pos= 0;
+  fputs("F ",chunkout);
+  fn_escaped(chunkout,path);
+  putc('\n',chunkout);
+}
+
+static void chunk_emit(struct chunker *ck) {
+  unsigned char digest[16];
+  int i;
+
+  MD5Final(digest,&ck->mc);
+  fprintf(chunkout, "C %" PRIu64 " %" PRIu64 " ",
+	  ck->start, ck->pos - ck->start);
+  for (i=0; i<sizeof(digest); i++)
+    fprintf(chunkout, "%02x", digest[i]);
+  putc('\n',chunkout);
+
+  MD5Init(&ck->mc);
+  ck->h= 0;
+  ck->start= ck->pos;
+}
+
+static void chunk_data(struct chunker *ck, const unsigned char *p, size_t l) {
+  uint64_t len;
+  size_t i;
+
+  while (l) {
+    len= ck->pos - ck->start;
+    /* no boundary can fall within the first CHUNKMIN bytes */
+    i= len < CHUNKMIN ? CHUNKMIN - len : 0;
+    for (; i<l; i++) {
+      ck->h= (ck->h << 1) + gear[p[i]];
+      if (!(ck->h & CHUNKMASK) || len+i+1 >= CHUNKMAX) { i++; goto boundary; }
+    }
+    MD5Update(&ck->mc,p,l);
+    ck->pos += l;
+    return;
+
+  boundary:
+    MD5Update(&ck->mc,p,i);
+    ck->pos += i;
+    chunk_emit(ck);
+    p += i;  l -= i;
+  }
+}
+
+static void chunk_end(struct chunker *ck, int ok) {
+  if (!ok) { fputs("E\n",chunkout); return; }
+  if (ck->pos > ck->start) chunk_emit(ck);
+}
+
+/*
+ * Content hashes (-H).  Each regular file is read once and fed to
+ * all of them.  With -j, a process with several hashes to compute
+ * uses up to that many threads to do it, each block of data being
+ * handed to all of them at once.
+ */
+
+struct hashalg {
+  const char *name;
+  const struct nettle_hash *h;
+  int tag;
+};
+static const struct hashalg hashalgs[]= {
+  { "md5",      &nettle_md5,      MFT_MD5      },
+  { "sha1",     &nettle_sha1,     MFT_SHA1     },
+  { "sha256",   &nettle_sha256,   MFT_SHA256   },
+  { "sha512",   &nettle_sha512,   MFT_SHA512   },
+  { "sha3-256", &nettle_sha3_256, MFT_SHA3_256 },
+};
+#define NHASHALGS ((int)(sizeof(hashalgs)/sizeof(hashalgs[0])))
+#define HASHESMAX (16+20+32+64+32) /* total digest size, all of them */
+
+static const struct hashalg *hashes[NHASHALGS]= { &hashalgs[0] };
+static int nhashes=1;
+static void *hashctx[NHASHALGS];
+static size_t hashbytes=16; /* total digest size */
+
+static int nhashthreads; /* not counting us */
+static pthread_mutex_t hash_mx= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_go= PTHREAD_COND_INITIALIZER;
+static pthread_cond_t hash_done= PTHREAD_COND_INITIALIZER;
+static const unsigned char *hash_p;
+static size_t hash_l;
+static unsigned long hash_seq;
+static int hash_pending;
+
+static void hashes_set(const char *list) {
+  const char *comma;
+  size_t l;
+  int i, j;
+
+  nhashes= 0;
+  hashbytes= 0;
+  for (;;) {
+    comma= strchr(list,',');
+    l= comma ? comma-list : strlen(list);
+    for (i=0; i<NHASHALGS; i++)
+      if (strlen(hashalgs[i].name)==l && !memcmp(hashalgs[i].name,list,l))
+	break;
+    if (i>=NHASHALGS) {
+      fprintf(stderr,"summer: unknown hash `%.*s'"
+	      " (md5 sha1 sha256 sha512 sha3-256)\n", (int)l, list);
+      exit(8);
+    }
+    for (j=0; j<nhashes; j++)
+      if (hashes[j]==&hashalgs[i]) { fputs("summer: duplicate hash\n",stderr);
+				     exit(8); }
+    hashes[nhashes++]= &hashalgs[i];
+    hashbytes += hashalgs[i].h->digest_size;
+    if (!comma) break;
+    list= comma+1;
+  }
+
+  hashxl= 0;
+  for (j=1; j<nhashes; j++) hashxl += 1 + hashes[j]->h->digest_size*2;
+  csumxl= hashes[0]->h->digest_size*2;
+  if (csumxl < CSUMXL) csumxl= CSUMXL;
+}
+
+/* Thread number t does hashes t, t+nhashthreads+1, ... */
+static void hashes_update_some(int t) {
+  int i;
+  for (i=t; i<nhashes; i += nhashthreads+1)
+    hashes[i]->h->update(hashctx[i], hash_l, hash_p);
+}
+
+static void *hash_thread(void *tv) {
+  int t= (intptr_t)tv;
+  unsigned long seq=0;
+
+  pthread_mutex_lock(&hash_mx);
+  for (;;) {
+    while (hash_seq == seq) pthread_cond_wait(&hash_go,&hash_mx);
+    seq= hash_seq;
+    pthread_mutex_unlock(&hash_mx);
+    hashes_update_some(t);
+    pthread_mutex_lock(&hash_mx);
+    if (!--hash_pending) pthread_cond_signal(&hash_done);
+  }
+  return 0; /* not reached */
+}
+
+static void hashes_init(void) {
+  pthread_t th;
+  int i, r;
+
+  if (!hashctx[0]) {
+    for (i=0; i<nhashes; i++) hashctx[i]= mmalloc(hashes[i]->h->context_size);
+    if (njobs>1 && nhashes>1) {
+      nhashthreads= (njobs < nhashes ? njobs : nhashes) - 1;
+      for (i=1; i<=nhashthreads; i++) {
+	r= pthread_create(&th, 0, hash_thread, (void*)(intptr_t)i);
+	if (r) { errno=r; perror("summer: pthread_create"); exit(12); }
+      }
+    }
+  }
+  for (i=0; i<nhashes; i++) hashes[i]->h->init(hashctx[i]);
+}
+
+static void hashes_update(const unsigned char *p, size_t l) {
+  if (!nhashthreads) {
+    hash_p= p;  hash_l= l;
+    hashes_update_some(0);
+    return;
+  }
+  pthread_mutex_lock(&hash_mx);
+  hash_p= p;  hash_l= l;
+  hash_pending= nhashthreads;
+  hash_seq++;
+  pthread_cond_broadcast(&hash_go);
+  pthread_mutex_unlock(&hash_mx);
+
+  hashes_update_some(0);
+
+  pthread_mutex_lock(&hash_mx);
+  while (hash_pending) pthread_cond_wait(&hash_done,&hash_mx);
+  pthread_mutex_unlock(&hash_mx);
+}
+
+static void hashes_final(unsigned char *out) {
+  int i;
+  for (i=0; i<nhashes; i++) {
+    hashes[i]->h->digest(hashctx[i], hashes[i]->h->digest_size, out);
+    out += hashes[i]->h->digest_size;
+  }
+}
+
+/* Prints the hash columns, from all the digests one after another */
+static void lb_digests(const unsigned char *all) {
+  int i, l;
+  for (i=0; i<nhashes; i++) {
+    l= hashes[i]->h->digest_size;
+    if (i) lb_char(' ');
+    lb_hex(all, l);
+    if (!i) lb_spaces(csumxl - l*2);
+    all += l;
+  }
+  hashcolsdone= 1;
+}
+
+/* After the first column, for objects with no hashes */
+static void lb_nohashes(void) {
+  int i;
+  for (i=1; i<nhashes; i++) {
+    lb_str(" -");
+    lb_spaces(hashes[i]->h->digest_size*2 - 1);
+  }
+}
+
+static void csum_feed(struct chunker *chunks,
+		      const unsigned char *p, size_t l) {
+  hashes_update(p,l);
+  if (chunks) chunk_data(chunks,p,l);
+}
+
+static void csum_zeroes(struct chunker *chunks, off_t l) {
+  static unsigned char *zeroes;
+  size_t n;
+
+  if (!zeroes) {
+    zeroes= mmalloc(READBUFSZ);
+    memset(zeroes,0,READBUFSZ);
+  }
+  while (l) {
+    n= l < READBUFSZ ? l : READBUFSZ;
+    csum_feed(chunks,zeroes,n);
+    l -= n;
+  }
+}
+
+/* Some filesystems accept O_DIRECT at open but then fail reads with
+ * EINVAL.  If that is what has just happened, replaces *fdp with an
+ * ordinary fd on the same file at the same position, and returns 1
+ * so that the read can be retried.  Otherwise returns 0, with errno
+ * unchanged. */
+static int directio_fallback(int *fdp, const char *path) {
+  struct stat was, now;
+  off_t pos;
+  int e= errno, fd;
+
+  if (e!=EINVAL || !directio || !(fcntl(*fdp,F_GETFL) & O_DIRECT)) return 0;
+  fd= -1;
+  if ((pos= lseek(*fdp,0,SEEK_CUR)) < 0 || fstat(*fdp,&was) ||
+      (fd= open(path, O_RDONLY|O_NOCTTY)) < 0 || fstat(fd,&now) ||
+      now.st_dev!=was.st_dev || now.st_ino!=was.st_ino ||
+      lseek(fd,pos,SEEK_SET) < 0) {
+    if (fd>=0) close(fd);
+    errno= e;
+    return 0;
+  }
+  posix_fadvise(fd, 0,0, POSIX_FADV_SEQUENTIAL);
+  close(*fdp);
+  *fdp= fd;
+  return 1;
+}
+
+/* Checksums the first size bytes of a sparse file, feeding holes in
+ * as zeroes without reading them.  Returns how far it got (which is
+ * less than size if the file shrank or SEEK_DATA is not supported),
+ * or -1 with *what_r set.  *fdp may be replaced (directio_fallback). */
+static off_t csum_sparse(int *fdp, const char *path, off_t size,
+			 struct chunker *chunks, unsigned char *db,
+			 const char **what_r) {
+  off_t pos=0, data, hole, want;
+  ssize_t r;
+  int fd= *fdp;
+
+  while (pos < size) {
+    data= lseek(fd,pos,SEEK_DATA);
+    if (data<0 && errno==ENXIO) data= size;
+    else if (data<0 && errno==EINVAL) return pos;
+    else if (data<0) { *what_r= "lseek SEEK_DATA"; return -1; }
+    if (data > size) data= size;
+    csum_zeroes(chunks,data-pos);
+    pos= data;
+    if (pos >= size) break;
+
+    hole= lseek(fd,pos,SEEK_HOLE);
+    if (hole<0) { *what_r= "lseek SEEK_HOLE"; return -1; }
+    if (lseek(fd,pos,SEEK_SET)<0) { *what_r= "lseek"; return -1; }
+    while (pos < hole) {
+      /* whole blocks, for O_DIRECT; any excess is zeroes, so harmless */
+      want= (hole-pos + READBUFALIGN-1) & ~(off_t)(READBUFALIGN-1);
+      r= read(fd,db, want < READBUFSZ ? want : READBUFSZ);
+      if (r<0) {
+	if (errno==EINTR) continue;
+	if (directio_fallback(fdp,path)) { fd= *fdp; continue; }
+	*what_r= "read";  return -1;
+      }
+      if (!r) return pos;
+      csum_feed(chunks,db,r);
+      pos += r;
+    }
+  }
+  return pos;
+}
+
+static size_t hardlink_hash(dev_t dev, ino_t ino);
+
+/*
+ * With -w, digests of the files we have read, so that we need not
+ * read them again unless they seem to have changed.  Entries not
+ * used during an emission are dropped at the end of it.
+ */
+
+struct digest {
+  dev_t dev;
+  ino_t ino; /* 0 means empty slot */
+  off_t size;
+  struct timespec mtime, ctime;
+  unsigned gen;
+  int linked; /* had more than one link */
+  unsigned char md[HASHESMAX]; /* as from hashes_final */
+};
+static struct digest *digests;
+static size_t digests_size, digests_used; /* size is 0 or 2^n */
+static unsigned watchgen;
+static int watchnewlink;
+
+static struct digest *digest_slot(struct digest *table, size_t size,
+				  dev_t dev, ino_t ino) {
+  size_t i;
+  struct digest *dg;
+
+  for (i= hardlink_hash(dev,ino);; i++) {
+    dg= &table[i & (size-1)];
+    if (!dg->ino || (dg->ino==ino && dg->dev==dev)) return dg;
+  }
+}
+
+static void digests_rebuild(size_t newsize, int purge) {
+  struct digest *old= digests, *dg;
+  size_t oldsize= digests_size, i;
+
+  digests_size= newsize;
+  digests= mmalloc(sizeof(*digests) * digests_size);
+  memset(digests, 0, sizeof(*digests) * digests_size);
+  digests_used= 0;
+  for (i=0; i<oldsize; i++) {
+    if (!old[i].ino) continue;
+    if (purge && old[i].gen != watchgen) continue;
+    dg= digest_slot(digests,digests_size, old[i].dev,old[i].ino);
+    *dg= old[i];
+    digests_used++;
+  }
+  free(old);
+}
+
+static struct digest *digest_find(dev_t dev, ino_t ino) {
+  struct digest *dg;
+  if (!digests_size || !ino) return 0;
+  dg= digest_slot(digests,digests_size, dev,ino);
+  return dg->ino ? dg : 0;
+}
+
+static int digest_get(const struct stat *stab, unsigned char *md) {
+  struct digest *dg= digest_find(stab->st_dev, stab->st_ino);
+
+  if (!dg ||
+      dg->size != stab->st_size ||
+      dg->mtime.tv_sec != stab->st_mtim.tv_sec ||
+      dg->mtime.tv_nsec != stab->st_mtim.tv_nsec ||
+      dg->ctime.tv_sec != stab->st_ctim.tv_sec ||
+      dg->ctime.tv_nsec != stab->st_ctim.tv_nsec)
+    return 0;
+  dg->gen= watchgen;
+  memcpy(md, dg->md, hashbytes);
+  return 1;
+}
+
+static void digest_put(const struct stat *stab, const unsigned char *md) {
+  struct digest *dg;
+
+  if (!stab->st_ino) return;
+  if (digests_used*4 >= digests_size*3)
+    digests_rebuild(digests_size ? digests_size*2 : 1024, 0);
+  dg= digest_slot(digests,digests_size, stab->st_dev,stab->st_ino);
+  if (!dg->ino) digests_used++;
+  dg->dev= stab->st_dev;
+  dg->ino= stab->st_ino;
+  dg->size= stab->st_size;
+  dg->mtime= stab->st_mtim;
+  dg->ctime= stab->st_ctim;
+  dg->gen= watchgen;
+  dg->linked= stab->st_nlink>1;
+  memcpy(dg->md, md, hashbytes);
+}
+
+static void csum_file(const char *path, const struct stat *stab) {
+  unsigned char *db= readbuf();
+  struct chunker ck, *chunks=0;
+  unsigned char digests[HASHESMAX], *dp;
+  const char *what;
+  off_t pos;
+  ssize_t r;
+  int fd, i;
+
+  if (watchout && digest_get(stab, digests)) {
+    lb_digests(digests);
+    return;
+  }
+
+  fd= -1;
+  if (directio) {
+    fd= open(path, O_RDONLY|O_NOCTTY|O_DIRECT);
+    /* EINVAL means the filesystem does not do O_DIRECT; fall back */
+    if (fd<0 && errno!=EINVAL)
+      { problem_e(path,csumxl,"open"); return; }
+  }
+  if (fd<0) fd= open(path, O_RDONLY|O_NOCTTY);
+  if (fd<0) { problem_e(path,csumxl,"open"); return; }
+
+  posix_fadvise(fd, 0,0, POSIX_FADV_SEQUENTIAL);
+
+  if (chunkout && stab->st_size >= chunkthreshold) {
+    chunks= &ck;
+    chunk_start(chunks,path);
+  }
+
+  hashes_init();
+  if ((off_t)stab->st_blocks*512 < stab->st_size) {
+    pos= csum_sparse(&fd, path, stab->st_size, chunks, db, &what);
+    if (pos<0) goto x_error;
+    what= "lseek";
+    if (lseek(fd,pos,SEEK_SET)<0) goto x_error;
+  }
+  /* the rest, or all of a non-sparse file */
+  what= "read";
+  for (;;) {
+    r= read(fd,db,READBUFSZ);
+    if (r<0) {
+      if (errno==EINTR) continue;
+      if (directio_fallback(&fd,path)) continue;
+      goto x_error;
+    }
+    if (!r) break;
+    csum_feed(chunks,db,r);
+  }
+  hashes_final(digests);
+  if (chunks) {
+    chunk_end(chunks,1);
+    if (ferror(chunkout)) { perror("summer: chunk file"); exit(12); }
+  }
+  if (binout)
+    for (i=0, dp=digests; i<nhashes; dp += hashes[i++]->h->digest_size)
+      mf_put_bytes(&binw, hashes[i]->tag, dp, hashes[i]->h->digest_size);
+  if (dropcache) posix_fadvise(fd, 0,0, POSIX_FADV_DONTNEED);
+  if (close(fd)) { problem_e(path,csumxl,"close"); return; }
+
+  lb_digests(digests);
+  if (watchout) digest_put(stab, digests);
+  return;
+
+ x_error:
+  if (chunks) chunk_end(chunks,0);
+  problem_e(path,csumxl,"%s",what);
+  close(fd);
+}
+
+static void csum_dev(int cb, const struct stat *stab) {
+  if (binout) mf_put_uint(&binw, MFT_RDEV, stab->st_rdev);
+  lb_printf("%c 0x%08lx %3lu %3lu %3lu %3lu    ", cb,
+	 (unsigned long)stab->st_rdev,
+	 ((unsigned long)stab->st_rdev & 0x0ff000000U) >> 24,
+	 ((unsigned long)stab->st_rdev & 0x000ff0000U) >> 16,
+	 ((unsigned long)stab->st_rdev & 0x00000ff00U) >> 8,
+	 ((unsigned long)stab->st_rdev & 0x0000000ffU) >> 0);
+  lb_spaces(csumxl - CSUMXL);
+}
+
+static void csum_str(const char *s) {
+  lb_str(s);
+  lb_spaces(csumxl - (int)strlen(s));
+}
+
+static void linktargpath(const char *linktarg) {
+  lb_str(" -> ");
+  lb_escaped(linktarg);
+}
+
+static void pu10(void) { lb_field("?",10); }
+static void putime(void) { lb_field("?",timewidth); }
+
+#define PTIME(stab, memb, tag)  \
+  ((stab) ? ptime((stab), &(stab)->memb, (tag), tag##NS) : putime())
+
+static void lb_nsec(long ns) {
+  int i;
+  if (notext) return;
+  lb_need(10);
+  lb[lbl++]= '.';
+  for (i=8; i>=0; i--) { lb[lbl+i]= '0' + ns % 10;  ns /= 10; }
+  lbl += 9;
+}
+
+static void ptime(const struct stat *stab, const struct timespec *ts,
+		  int tag, int nstag) {
+  const char *instead;
+
+  if (!hidextime) goto justprint;
+  else if (S_ISCHR(stab->st_mode)) instead= "char";
+  else if (S_ISBLK(stab->st_mode)) instead= "block";
+  else if (S_ISLNK(stab->st_mode)) instead= "link";
+  else if (S_ISSOCK(stab->st_mode)) instead= "sock";
+  else if (S_ISFIFO(stab->st_mode)) instead= "pipe";
+  else {
+  justprint:
+    lb_num(ts->tv_sec,10,10);
+    if (binout) mf_put_time(&binw, tag, ts->tv_sec);
+    if (nsectimes) {
+      lb_nsec(ts->tv_nsec);
+      if (binout) mf_put_uint(&binw, nstag, ts->tv_nsec);
+    }
+    return;
+  }
+
+  lb_field(instead,timewidth);
+}
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used, size;
+  char data[];
+};
+struct arena { struct arena_chunk *chunks; };
+
+static char *arena_strdup(struct arena *a, const char *s) {
+  struct arena_chunk *c= a->chunks;
+  size_t l= strlen(s)+1, sz;
+  char *r;
+
+  if (!c || c->size - c->used < l) {
+    sz= l > ARENACHUNK ? l : ARENACHUNK;
+    c= mmalloc(sizeof(*c) + sz);
+    c->size= sz;
+    c->used= 0;
+    c->next= a->chunks;
+    a->chunks= c;
+  }
+  r= c->data + c->used;
+  memcpy(r,s,l);
+  c->used += l;
+  return r;
+}
+
+static void arena_free(struct arena *a) {
+  struct arena_chunk *c, *next;
+  for (c=a->chunks; c; c=next) { next= c->next; free(c); }
+  a->chunks= 0;
+}
+
+struct hardlink {
+  dev_t dev;
+  ino_t ino;
+  const char *path; /* 0 means empty slot */
+};
+static struct hardlink *hardlinks;
+static size_t hardlinks_size, hardlinks_used; /* size is 0 or 2^n */
+static struct arena hardlinks_paths;
+
+static size_t hardlink_hash(dev_t dev, ino_t ino) {
+  uint64_t h= (uint64_t)ino * 0x9e3779b97f4a7c15ULL;
+  h ^= (uint64_t)dev * 0xc2b2ae3d27d4eb4fULL;
+  return h ^ (h >> 29);
+}
+
+static struct hardlink *hardlink_slot(struct hardlink *table, size_t size,
+				      dev_t dev, ino_t ino) {
+  size_t i;
+  struct hardlink *hl;
+
+  for (i= hardlink_hash(dev,ino);; i++) {
+    hl= &table[i & (size-1)];
+    if (!hl->path || (hl->ino==ino && hl->dev==dev)) return hl;
+  }
+}
+
+static void hardlinks_grow(void) {
+  struct hardlink *old= hardlinks, *hl;
+  size_t oldsize= hardlinks_size, i;
+
+  hardlinks_size= oldsize ? oldsize*2 : 1024;
+  hardlinks= mmalloc(sizeof(*hardlinks) * hardlinks_size);
+  memset(hardlinks, 0, sizeof(*hardlinks) * hardlinks_size);
+  for (i=0; i<oldsize; i++) {
+    if (!old[i].path) continue;
+    hl= hardlink_slot(hardlinks,hardlinks_size, old[i].dev,old[i].ino);
+    *hl= old[i];
+  }
+  free(old);
+}
+
+/* Returns the path of an earlier link to the same object, or 0 if
+ * this is the first time we have seen it (in which case it is
+ * recorded under path). */
+static const char *hardlink_lookup(dev_t dev, ino_t ino, const char *path) {
+  struct hardlink *hl;
+
+  if (hardlinks_used*4 >= hardlinks_size*3) hardlinks_grow();
+  hl= hardlink_slot(hardlinks,hardlinks_size, dev,ino);
+  if (hl->path) return hl->path;
+
+  hl->dev= dev;
+  hl->ino= ino;
+  hl->path= arena_strdup(&hardlinks_paths, path);
+  hardlinks_used++;
+  return 0;
+}
+
+static int hardlink_present(dev_t dev, ino_t ino) {
+  return hardlinks_size &&
+    hardlink_slot(hardlinks,hardlinks_size, dev,ino)->path;
+}
+
+static void hardlinks_reset(void) {
+  free(hardlinks);
+  hardlinks= 0;
+  hardlinks_size= hardlinks_used= 0;
+  arena_free(&hardlinks_paths);
+}
+
+static void bin_kind(const struct stat *stab, const char *foundhl,
+		     int mountpoint) {
+  int k;
+
+  if (!stab) k= MFK_PROBLEM;
+  else if (foundhl) k= MFK_HARDLINK;
+  else if (S_ISREG(stab->st_mode)) k= MFK_FILE;
+  else if (S_ISCHR(stab->st_mode)) k= MFK_CHR;
+  else if (S_ISBLK(stab->st_mode)) k= MFK_BLK;
+  else if (S_ISFIFO(stab->st_mode)) k= MFK_PIPE;
+  else if (S_ISLNK(stab->st_mode)) k= MFK_SYMLINK;
+  else if (S_ISSOCK(stab->st_mode)) k= MFK_SOCK;
+  else if (S_ISDIR(stab->st_mode)) k= mountpoint ? MFK_MOUNTPOINT : MFK_DIR;
+  else k= MFK_PROBLEM;
+  mf_put_uint(&binw, MFT_KIND, k);
+}
+
+/*
+ * Like lstat, but using statx so that we can ask only for what we
+ * are going to print (which matters on network filesystems), and
+ * get the birth time.  btime->tv_nsec is -1 if it is not known.
+ */
+static int node_stat(const char *path, struct stat *st,
+		     struct timespec *btime) {
+  struct statx stx;
+
+  btime->tv_nsec= -1;
+  if (!usestatx) return lstat(path,st);
+  if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW|statxsync, statxmask, &stx)) {
+    if (errno!=ENOSYS) return -1;
+    usestatx= 0; /* kernel too old */
+    return lstat(path,st);
+  }
+
+  memset(st,0,sizeof(*st));
+  st->st_dev= makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  st->st_ino= stx.stx_ino;
+  st->st_mode= stx.stx_mode;
+  st->st_nlink= stx.stx_nlink;
+  st->st_uid= stx.stx_uid;
+  st->st_gid= stx.stx_gid;
+  st->st_rdev= makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+  st->st_size= stx.stx_size;
+  st->st_blksize= stx.stx_blksize;
+  st->st_blocks= stx.stx_blocks;
+  st->st_atim.tv_sec= stx.stx_atime.tv_sec;
+  st->st_atim.tv_nsec= stx.stx_atime.tv_nsec;
+  st->st_mtim.tv_sec= stx.stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec= stx.stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec= stx.stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec= stx.stx_ctime.tv_nsec;
+  if (stx.stx_mask & STATX_BTIME) {
+    btime->tv_sec= stx.stx_btime.tv_sec;
+    btime->tv_nsec= stx.stx_btime.tv_nsec;
+  }
+  return 0;
+}
+
+static void descend(unsigned nodeflags, dev_t fs, uint64_t recoff);
+
+/* With -w, what node() did, for the cache of its directory */
+static struct {
+  int uncacheable, hldir, descended;
+  dev_t dev;  ino_t ino;
+  unsigned nodeflags;  dev_t fs;
+} lastnode;
+
+static void node(const char *path, unsigned nodeflags, dev_t fs) {
+  char linktarg[MAXFN+1];
+  const char *foundhl;
+  const struct stat *stab;
+  struct stat stabuf;
+  struct timespec btime;
+  struct digest *dg;
+  uint64_t recoff=0;
+  double t0=0;
+  int r, mountpoint=0;
+
+  if (profiling) t0= prof_now();
+  r= node_stat(path, &stabuf, &btime);
+  if (profiling) prof_add(PH_STAT, t0, 0);
+  stab= r ? 0 : &stabuf;
+
+  foundhl= 0;
+  if (stab && stab->st_nlink>1)
+    foundhl= hardlink_lookup(stab->st_dev, stab->st_ino, path);
+
+  if (watchout) {
+    memset(&lastnode,0,sizeof(lastnode));
+    if (stab) {
+      lastnode.dev= stab->st_dev;
+      lastnode.ino= stab->st_ino;
+    }
+    if (stab && stab->st_nlink>1) {
+      /* hardlinks to files elsewhere cannot be replayed */
+      if (foundhl || !S_ISDIR(stab->st_mode)) lastnode.uncacheable= 1;
+      lastnode.hldir= 1;
+      if (S_ISREG(stab->st_mode) && !foundhl) {
+	/* the other link may be in a directory we have remembered */
+	dg= digest_find(stab->st_dev, stab->st_ino);
+	if (!dg || !dg->linked) watchnewlink= 1;
+      }
+    }
+  }
+
+  if (stab) {
+    if ((nodeflags & nodeflag_fsvalid) && stab->st_dev != fs)
+      mountpoint= 1;
+    fs= stab->st_dev;
+    nodeflags |= nodeflag_fsvalid;
+  }
+
+  if (binout) {
+    mf_put_str(&binw, MFT_PATH, path);
+    bin_kind(stab, foundhl, mountpoint);
+  }
+
+  hashcolsdone= 0;
+  if (!stab) problem_e(path,csumxl,"inaccessible");
+  else if (foundhl) csum_str("hardlink");
+  else if (S_ISREG(stab->st_mode)) {
+    if (profiling) t0= prof_now();
+    csum_file(path,stab);
+    if (profiling) {
+      prof_add(PH_HASH, t0, stab->st_size);
+      prof_top(prof_files, prof_now()-t0, 0, stab->st_size,
+	       path,strlen(path));
+    }
+  }
+  else if (S_ISCHR(stab->st_mode)) csum_dev('c',stab);
+  else if (S_ISBLK(stab->st_mode)) csum_dev('b',stab);
+  else if (S_ISFIFO(stab->st_mode)) csum_str("pipe");
+  else if (S_ISLNK(stab->st_mode)) csum_str("symlink");
+  else if (S_ISSOCK(stab->st_mode)) csum_str("sock");
+  else if (S_ISDIR(stab->st_mode)) csum_str(mountpoint ? "mountpoint" : "dir");
+  else problem(path,csumxl,"badobj: 0x%lx", (unsigned long)stab->st_mode);
+  if (!hashcolsdone) lb_nohashes();
+
+  if (stab && S_ISLNK(stab->st_mode)) {
+    r= readlink(path, linktarg, sizeof(linktarg)-1);
+    if (r==sizeof(linktarg)) { problem(path,-1,"readlink too big"); r=-1; }
+    else if (r<0) { problem_e(path,-1,"readlink"); }
+    else assert(r<sizeof(linktarg));
+
+    if (r<0) strcpy(linktarg,"\\?");
+    else linktarg[r]= 0;
+    if (binout && r>=0) mf_put_str(&binw, MFT_TARGET, linktarg);
+  }
+
+  if (stab) {
+    if (S_ISDIR(stab->st_mode) && hidedirsize)
+      lb_field("dir",10);
+    else {
+      lb_num(stab->st_size,10,10);
+      if (binout) mf_put_uint(&binw, MFT_SIZE, stab->st_size);
+    }
+    if (showalloc) {
+      lb_num((uint64_t)stab->st_blocks * 512, 10,10);
+      if (binout) mf_put_uint(&binw, MFT_ALLOC, (uint64_t)stab->st_blocks*512);
+    }
+
+    lb_num(stab->st_mode & 07777U, 8,4);
+    lb_num(stab->st_uid, 10,10);
+    lb_num(stab->st_gid, 10,10);
+    if (binout) {
+      mf_put_uint(&binw, MFT_MODE, stab->st_mode & 07777U);
+      mf_put_uint(&binw, MFT_UID, stab->st_uid);
+      mf_put_uint(&binw, MFT_GID, stab->st_gid);
+    }
+  } else {
+    pu10();
+    if (showalloc) pu10();
+    lb_field("?",4);
+    pu10();
+    pu10();
+  }
+
+  if (!hideatime)
+    PTIME(stab, st_atim, MFT_ATIME);
+
+  if (!hidemtime) {
+    if (stab && S_ISLNK(stab->st_mode) && hidelinkmtime)
+      lb_field("link",timewidth);
+    else
+      PTIME(stab, st_mtim, MFT_MTIME);
+  }
+
+  if (!hidectime)
+    PTIME(stab, st_ctim, MFT_CTIME);
+
+  if (showbtime) {
+    if (stab && btime.tv_nsec >= 0) ptime(stab, &btime, MFT_BTIME,MFT_BTIMENS);
+    else putime();
+  }
+
+  lb_char(filenamefieldsep);
+  lb_escaped(path);
+
+  if (foundhl) linktargpath(foundhl);
+  if (stab && S_ISLNK(stab->st_mode)) linktargpath(linktarg);
+
+  lb_endline();
+  if (binout) {
+    if (foundhl) mf_put_str(&binw, MFT_HARDLINK, foundhl);
+    recoff= binw.offset;
+    bin_rec_end(path);
+  }
+
+  if (ferror(stdout)) { perror("summer: stdout"); exit(12); }
+
+  if (stab && S_ISDIR(stab->st_mode) && !(mountpoint && onefilesystem))
+    descend(nodeflags, fs, recoff);
+}
+
+/*
+ * Exclusions (-e, -E, -X).  These are applied to the names read
+ * from each directory, so an excluded object is never statted, let
+ * alone descended into or read.  Globs without a / match just the
+ * name; globs with a /, and regexps, match the whole path.
+ */
+
+struct exclude {
+  const char *glob; /* 0 for a regexp */
+  int pathname;
+  regex_t re;
+};
+static struct exclude *excludes;
+static size_t nexcludes, excludes_allocd;
+static int excludepaths; /* some rule needs the whole path in pathbuf */
+
+static void exclude_add(int isregex, const char *pat) {
+  struct exclude *ex;
+  char errbuf[256], *anchored;
+  int r;
+
+  if (nexcludes >= excludes_allocd) {
+    excludes_allocd= excludes_allocd ? excludes_allocd*2 : 16;
+    excludes= mrealloc(excludes, sizeof(*excludes) * excludes_allocd);
+  }
+  ex= &excludes[nexcludes];
+  memset(ex,0,sizeof(*ex));
+  if (isregex) {
+    /* it must match the whole path, not just some of it */
+    anchored= mmalloc(strlen(pat)+5);
+    sprintf(anchored,"^(%s)$",pat);
+    r= regcomp(&ex->re, anchored, REG_EXTENDED|REG_NOSUB);
+    if (r) {
+      regerror(r, &ex->re, errbuf, sizeof(errbuf));
+      fprintf(stderr,"summer: bad exclusion regexp `%s': %s\n",pat,errbuf);
+      exit(8);
+    }
+    free(anchored);
+    ex->pathname= 1;
+  } else {
+    ex->glob= strcpy(mmalloc(strlen(pat)+1), pat);
+    ex->pathname= !!strchr(pat,'/');
+  }
+  if (ex->pathname) excludepaths= 1;
+  nexcludes++;
+}
+
+static void exclude_file(const char *path) {
+  char buf[MAXFN+2];
+  FILE *f;
+  int l;
+
+  f= fopen(path,"r");
+  if (!f) { perror("summer: open exclusions file"); exit(8); }
+  while (fgets(buf,sizeof(buf),f)) {
+    l= strlen(buf);
+    if (buf[l-1]!='\n' && !feof(f)) {
+      fprintf(stderr,"summer: exclusions file: line too long\n"); exit(8);
+    }
+    if (buf[l-1]=='\n') buf[--l]= 0;
+    if (!l || buf[0]=='#') continue;
+    if (buf[0]=='~') exclude_add(1, buf+1);
+    else exclude_add(0, buf);
+  }
+  if (ferror(f) || fclose(f)) {
+    perror("summer: read exclusions file"); exit(8);
+  }
+}
+
+/* path need only be right if excludepaths */
+static int excluded(const char *name, const char *path) {
+  const struct exclude *ex;
+
+  for (ex=excludes; ex<excludes+nexcludes; ex++) {
+    if (!ex->glob) {
+      if (!regexec(&ex->re, path, 0,0,0)) return 1;
+    } else if (ex->pathname) {
+      if (!fnmatch(ex->glob, path, FNM_PATHNAME)) return 1;
+    } else {
+      if (!fnmatch(ex->glob, name, 0)) return 1;
+    }
+  }
+  return 0;
+}
+
+/* With -S, instead of node() for an excluded object */
+static void node_excluded(const char *path) {
+  if (watchout) memset(&lastnode,0,sizeof(lastnode));
+  if (binout) {
+    mf_put_str(&binw, MFT_PATH, path);
+    mf_put_uint(&binw, MFT_KIND, MFK_EXCLUDED);
+  }
+  csum_str("excluded");
+  lb_nohashes();
+  pu10();
+  if (showalloc) pu10();
+  lb_field("?",4);
+  pu10();
+  pu10();
+  if (!hideatime) putime();
+  if (!hidemtime) putime();
+  if (!hidectime) putime();
+  if (showbtime) putime();
+  lb_char(filenamefieldsep);
+  lb_escaped(path);
+  lb_endline();
+  if (binout) bin_rec_end(path);
+}
+
+/*
+ * The tree is walked iteratively.  Each directory we are inside has
+ * a struct dirframe on the dirs stack; its entries' names are in the
+ * names buffer, and their offsets in nameoffs (sorted).  Both are
+ * used as stacks, so a directory's names are discarded as soon as we
+ * have finished with it.  pathbuf holds the path of the current node.
+ */
+
+/* With -w, what we remember about a directory; see "Watching" */
+struct dcitem {
+  size_t textoff, textlen, nameoff;
+  unsigned nodeflags;
+  dev_t fs, dev;
+  ino_t ino;
+  unsigned char hldir, descended;
+};
+
+struct dircache {
+  struct dircache *next, *wdnext; /* hash chains */
+  char *path;
+  int wd; /* -1 if not watched */
+  int dirty, valid;
+  unsigned gen; /* last emission which used us */
+  struct dcitem *items;  size_t nitems, itemsallocd;
+  char *text;  size_t textlen, textallocd;
+  char *dnames;  size_t dnameslen, dnamesallocd;
+};
+
+struct dirframe {
+  size_t pathl;      /* length of directory path including final / */
+  unsigned nodeflags;
+  dev_t fs;
+  size_t offs0, noffs, next; /* entries in nameoffs, or items in dc */
+  size_t names0;             /* start of our names in names */
+  struct dircache *dc;       /* -w only: being filled in, or replayed */
+  int replay;
+  double secs;               /* -P only: time taken by our entries, */
+  double phsecs[PH_MAX];     /*  and in each phase, */
+  uint64_t bytes;            /*  and bytes they checksummed */
+};
+
+static struct dirframe *dirs;
+static size_t ndirs, dirs_allocd;
+static char *names, *pathbuf;
+static size_t names_used, names_allocd, pathlen, path_allocd;
+static size_t *nameoffs, nnameoffs, nameoffs_allocd;
+static size_t walk_peakmem, walk_peakdepth;
+
+static void path_set(size_t l, const char *s) {
+  size_t sl= strlen(s);
+  if (l+sl+1 > path_allocd) {
+    path_allocd= (l+sl+1)*2;
+    pathbuf= mrealloc(pathbuf, path_allocd);
+  }
+  memcpy(pathbuf+l, s, sl+1);
+  pathlen= l+sl;
+}
+
+#define nameflag_excluded 1u
+
+/* Each name is preceded in names by a byte of nameflag_* */
+static void name_add(const char *name, unsigned flags) {
+  size_t l= strlen(name)+1;
+
+  if (names_used+1+l > names_allocd) {
+    names_allocd= (names_used+1+l)*2;
+    names= mrealloc(names, names_allocd);
+  }
+  if (nnameoffs >= nameoffs_allocd) {
+    nameoffs_allocd= nameoffs_allocd ? nameoffs_allocd*2 : 1024;
+    nameoffs= mrealloc(nameoffs, sizeof(*nameoffs) * nameoffs_allocd);
+  }
+  names[names_used++]= flags;
+  memcpy(names+names_used, name, l);
+  nameoffs[nnameoffs++]= names_used;
+  names_used += l;
+}
+
+static int name_compar(const void *av, const void *bv) {
+  const size_t *a=av, *b=bv;
+  return strcmp(names + *a, names + *b);
+}
+
+static struct dirframe *dir_push(unsigned nodeflags, dev_t fs) {
+  struct dirframe *f;
+
+  if (ndirs >= dirs_allocd) {
+    dirs_allocd= dirs_allocd ? dirs_allocd*2 : 64;
+    dirs= mrealloc(dirs, sizeof(*dirs) * dirs_allocd);
+  }
+  f= &dirs[ndirs++];
+  memset(f,0,sizeof(*f));
+  path_set(pathlen, "/");
+  f->pathl= pathlen;
+  f->nodeflags= nodeflags;
+  f->fs= fs;
+  f->names0= names_used;
+  f->offs0= nnameoffs;
+  if (ndirs > walk_peakdepth) walk_peakdepth= ndirs;
+  return f;
+}
+
+static struct dircache *watch_descend(unsigned nodeflags, dev_t fs);
+
+/* Reads the directory in pathbuf (which node has just printed) and
+ * pushes it onto dirs, or reports the problem. */
+static void descend(unsigned nodeflags, dev_t fs, uint64_t recoff) {
+  struct dirframe *f;
+  struct dircache *dc=0;
+  struct dirent *de;
+  size_t names0= names_used, offs0= nnameoffs, l0;
+  unsigned flags;
+  double t0=0;
+  int esave;
+  DIR *d;
+
+  if (watchout) {
+    lastnode.descended= 1;
+    lastnode.nodeflags= nodeflags;
+    lastnode.fs= fs;
+    dc= watch_descend(nodeflags, fs);
+    if (!dc) return; /* replaying from the cache */
+  }
+
+  if (treehash) tree_push(recoff);
+
+  if (profiling) t0= prof_now();
+  l0= pathlen;
+  d= opendir(pathbuf);
+  if (!d) goto x_problem;
+  for (;;) {
+    errno= 0;
+    de= readdir(d);
+    if (!de) break;
+    if (de->d_name[0]=='.' &&
+	(de->d_name[1]==0 ||
+	 (de->d_name[1]=='.' &&
+	  de->d_name[2]==0)))
+      continue;
+    flags= 0;
+    if (nexcludes) {
+      if (excludepaths) { path_set(l0,"/");  path_set(l0+1,de->d_name); }
+      if (excluded(de->d_name, pathbuf)) {
+	if (!showexcluded) continue;
+	flags |= nameflag_excluded;
+      }
+    }
+    name_add(de->d_name, flags);
+  }
+  esave= errno;
+  closedir(d);
+  if (excludepaths) path_set(l0,"");
+  if (esave) {
+    errno= esave;
+    names_used= names0;  nnameoffs= offs0;
+    goto x_problem;
+  }
+  qsort(nameoffs+offs0, nnameoffs-offs0, sizeof(*nameoffs), name_compar);
+  if (profiling) prof_add(PH_READDIR, t0, 0);
 
-#define MAXFN 2048
-#define MAXDEPTH 1024
-#define CSUMXL 32
+  f= dir_push(nodeflags, fs);
+  f->names0= names0;
+  f->offs0= offs0;
+  f->noffs= nnameoffs-offs0;
+  f->dc= dc;
+  return;
 
-static int quiet=0, hidectime=0, hideatime=0, hidemtime=0;
-static int hidedirsize=0, hidelinkmtime=0, hidextime=0, onefilesystem=0;
-static int filenamefieldsep=' ';
-static FILE *errfile;
+ x_problem:
+  esave= errno;
+  lastnode.uncacheable= 1;
+  if (dc) dc->valid= 0;
+  path_set(pathlen, "/");
+  errno= esave;
+  if (binout) {
+    mf_put_str(&binw, MFT_PATH, pathbuf);
+    mf_put_uint(&binw, MFT_KIND, MFK_PROBLEM);
+  }
+  problem_e(pathbuf,csumxl+hashxl+72,"scandir failed");
+  lb_escaped(pathbuf);  lb_endline();
+  if (binout) bin_rec_end(pathbuf);
+  if (treehash) tree_pop();
+}
 
-#define nodeflag_fsvalid       1u
+static void ascend(void) {
+  struct dirframe *f= &dirs[--ndirs];
+  if (profiling)
+    prof_top(prof_dirs, f->secs, f->phsecs, f->bytes, pathbuf, f->pathl-1);
+  names_used= f->names0;
+  nnameoffs= f->offs0;
+  if (treehash && !f->replay) tree_pop();
+}
 
-static void malloc_fail(void) { perror("summer: alloc failed"); exit(12); }
+static void walk_reset(void) {
+  size_t mem= names_allocd + path_allocd +
+    sizeof(*nameoffs) * nameoffs_allocd + sizeof(*dirs) * dirs_allocd;
+  if (mem > walk_peakmem) walk_peakmem= mem;
 
-static void *mmalloc(size_t sz) {
-  void *r;
-  r= malloc(sz);  if (!r) malloc_fail();
-  return r;
+  free(dirs);  free(names);  free(nameoffs);  free(pathbuf);
+  dirs= 0;  names= pathbuf= 0;  nameoffs= 0;
+  dirs_allocd= names_allocd= nameoffs_allocd= path_allocd= 0;
+  names_used= nnameoffs= 0;
 }
 
-static void *mrealloc(void *p, size_t sz) {
-  void *r;
-  r= realloc(p, sz);  if (!r && sz) malloc_fail();
-  return r;
-}
+static void watch_replay(struct dirframe *f);
+static void watch_cacheitem(struct dircache *dc, const char *name);
 
-static void fn_escaped(FILE *f, const char *fn) {
-  int c;
-  while ((c= *fn++)) {
-    if (c>=33 && c<=126 && c!='\\') putc(c,f);
-    else fprintf(f,"\\x%02x",(int)(unsigned char)c);
+static void process(const char *startpoint) {
+  struct dirframe *f;
+  size_t fi, nameoff;
+  double t0=0, ph0[PH_MAX];
+  uint64_t bytes0=0;
+  int ph;
+
+  if (!quiet)
+    fprintf(stderr,"summer: processing: %s\n",startpoint);
+
+  path_set(0, startpoint);
+  node(pathbuf, 0,0);
+  while (ndirs) {
+    fi= ndirs-1;
+    f= &dirs[fi];
+    if (f->replay) { watch_replay(f); continue; }
+    if (f->next >= f->noffs) { ascend(); continue; }
+    nameoff= nameoffs[f->offs0 + f->next++];
+    path_set(f->pathl, names + nameoff);
+    linecap_len= 0;
+    if (names[nameoff-1] & nameflag_excluded) {
+      node_excluded(pathbuf);
+      if (dirs[fi].dc) watch_cacheitem(dirs[fi].dc, names + nameoff);
+      continue;
+    }
+    if (profiling) {
+      for (ph=0; ph<PH_MAX; ph++) ph0[ph]= prof_phases[ph].secs;
+      bytes0= prof_phases[PH_HASH].bytes;
+      t0= prof_now();
+    }
+    node(pathbuf, f->nodeflags, f->fs); /* may invalidate f and names */
+    if (profiling) {
+      dirs[fi].secs += prof_now() - t0;
+      for (ph=0; ph<PH_MAX; ph++)
+	dirs[fi].phsecs[ph] += prof_phases[ph].secs - ph0[ph];
+      dirs[fi].bytes += prof_phases[PH_HASH].bytes - bytes0;
+      if (prof_sigreport) { prof_sigreport= 0;  prof_report(); }
+    }
+    if (dirs[fi].dc) watch_cacheitem(dirs[fi].dc, names + nameoff);
   }
+
+  hardlinks_reset();
+  walk_reset();
 }
 
-static void add_pr(int *pr, int printf_ret) {
-  if (printf_ret == EOF) return;
-  *pr += printf_ret;
+static void walk_report(void) {
+  if (quiet) return;
+  fprintf(stderr, "summer: traversal used at most %zu bytes,"
+	  " depth %zu\n", walk_peakmem, walk_peakdepth);
 }
 
-static void vproblemx(const char *path, int padto, int per,
-		      const char *fmt, va_list al) {
-  int e=errno, pr=0;
-  
-  if (errfile==stderr) fputs("summer: error: ",stderr);
-  else add_pr(&pr, fprintf(errfile,"\\["));
-  
-  add_pr(&pr, vfprintf(errfile,fmt,al));
-  if (per) add_pr(&pr, fprintf(errfile,": %s",strerror(e)));
+/*
+ * With -j, each startpoint is processed by a child process, which
+ * writes its output (text, and -m and -k if applicable) to temporary
+ * spool files.  We emit the spools strictly in startpoint order.  At
+ * most njobs children run at once, at most one per device, and we
+ * do not get more than JOBSAHEAD*njobs startpoints ahead of the
+ * output.
+ */
 
-  if (errfile==stderr) {
-    fputs(": ",stderr);
-    fn_escaped(stderr,path);
-    fputc('\n',stderr);
-    exit(2);
-  }
+#define JOBSAHEAD 4
+
+struct job {
+  char *startpoint;
+  dev_t dev;
+  int devvalid;
+  pid_t pid; /* 0: not started; -1: finished */
+  int status;
+  FILE *text, *bin, *chunks;
+};
 
-  add_pr(&pr, printf("]"));
+static struct job *jobs;
+static size_t njobsq, jobs_allocd;
+static int jobsrunning;
 
-  while (pr++ < padto)
-    putchar(' ');
-}  
+static void job_add(const char *startpoint) {
+  struct job *j;
+  struct stat stab;
 
-static void problem_e(const char *path, int padto, const char *fmt, ...) {
-  va_list(al);
-  va_start(al,fmt);
-  vproblemx(path,padto,1,fmt,al);
-  va_end(al);
+  if (njobsq >= jobs_allocd) {
+    jobs_allocd= jobs_allocd ? jobs_allocd*2 : 64;
+    jobs= mrealloc(jobs, sizeof(*jobs) * jobs_allocd);
+  }
+  j= &jobs[njobsq++];
+  memset(j,0,sizeof(*j));
+  j->startpoint= mmalloc(strlen(startpoint)+1);
+  strcpy(j->startpoint, startpoint);
+  if (!lstat(startpoint,&stab)) { j->dev= stab.st_dev;  j->devvalid= 1; }
 }
 
-static void problem(const char *path, int padto, const char *fmt, ...) {
-  va_list(al);
-  va_start(al,fmt);
-  vproblemx(path,padto,0,fmt,al);
-  va_end(al);
+static FILE *spool(void) {
+  FILE *f= tmpfile();
+  if (!f) { perror("summer: create spool file"); exit(12); }
+  return f;
 }
 
-static void csum_file(const char *path) {
-  FILE *f;
-  MD5_CTX mc;
-  char db[65536];
-  unsigned char digest[16];
-  size_t r;
-  int i;
+static void job_start(struct job *j) {
+  j->text= spool();
+  if (binout) j->bin= spool();
+  if (chunkout) j->chunks= spool();
 
-  f= fopen(path,"rb");
-  if (!f) { problem_e(path,sizeof(digest)*2,"open"); return; }
-  
-  MD5Init(&mc);
-  for (;;) {
-    r= fread(db,1,sizeof(db),f);
-    if (ferror(f)) {
-      problem_e(path,sizeof(digest)*2,"read");
-      fclose(f); return;
+  fflush(stdout);  fflush(stderr);
+  if (binout) fflush(binout);
+  if (chunkout) fflush(chunkout);
+
+  j->pid= fork();
+  if (j->pid<0) { perror("summer: fork"); exit(12); }
+  if (j->pid) { jobsrunning++; return; }
+
+  if (dup2(fileno(j->text),1) < 0) { perror("summer: dup2"); exit(12); }
+  if (binout) { binout= j->bin;  mf_start(&binw, binout); }
+  if (chunkout) chunkout= j->chunks;
+
+  process(j->startpoint);
+
+  if (ferror(stdout) || fflush(stdout)) {
+    perror("summer: stdout spool"); exit(12);
+  }
+  if (binout) {
+    mf_finish(&binw);
+    if (ferror(binout) || fflush(binout)) {
+      perror("summer: manifest spool"); exit(12);
     }
-    if (!r) { assert(feof(f)); break; }
-    MD5Update(&mc,db,r);
   }
-  MD5Final(digest,&mc);
-  if (fclose(f)) { problem_e(path,sizeof(digest)*2,"close"); return; }
-
-  for (i=0; i<sizeof(digest); i++)
-    printf("%02x", digest[i]);
+  if (chunkout && (ferror(chunkout) || fflush(chunkout))) {
+    perror("summer: chunk spool"); exit(12);
+  }
+  walk_report();
+  if (profiling) prof_report();
+  _exit(0);
 }
 
-static void csum_dev(int cb, const struct stat *stab) {
-  printf("%c 0x%08lx %3lu %3lu %3lu %3lu    ", cb,
-	 (unsigned long)stab->st_rdev,
-	 ((unsigned long)stab->st_rdev & 0x0ff000000U) >> 24,
-	 ((unsigned long)stab->st_rdev & 0x000ff0000U) >> 16,
-	 ((unsigned long)stab->st_rdev & 0x00000ff00U) >> 8,
-	 ((unsigned long)stab->st_rdev & 0x0000000ffU) >> 0);
+static void copy_spool(FILE *from, FILE *to) {
+  char buf[65536];
+  size_t r;
+
+  if (fseeko(from, 0, SEEK_SET)) { perror("summer: rewind spool"); exit(12); }
+  while ((r= fread(buf,1,sizeof(buf),from)) > 0)
+    fwrite(buf,1,r,to);
+  if (ferror(from)) { perror("summer: read spool"); exit(12); }
+  if (ferror(to)) { perror("summer: write output"); exit(12); }
+  fclose(from);
 }
 
-static void csum_str(const char *s) {
-  printf("%-*s", CSUMXL, s);
+static void job_emit(struct job *j) {
+  size_t i;
+
+  copy_spool(j->text, stdout);
+  if (j->chunks) copy_spool(j->chunks, chunkout);
+  if (!j->status) {
+    if (j->bin) {
+      mf_append(&binw, j->bin, "manifest spool");
+      fclose(j->bin);
+    }
+    return;
+  }
+
+  /* the child has reported the problem; stop, just as we would have */
+  fflush(stdout);
+  for (i=0; i<njobsq; i++)
+    if (jobs[i].pid > 0) kill(jobs[i].pid, SIGTERM);
+  if (WIFEXITED(j->status)) exit(WEXITSTATUS(j->status));
+  fprintf(stderr,"summer: worker for %s died (signal %d)\n",
+	  j->startpoint, WTERMSIG(j->status));
+  exit(12);
 }
 
-static void linktargpath(const char *linktarg) {
-  printf(" -> ");
-  fn_escaped(stdout, linktarg);
+static int job_devbusy(const struct job *j, size_t head, size_t end) {
+  size_t i;
+
+  if (!j->devvalid) return 0;
+  for (i=head; i<end; i++)
+    if (jobs[i].pid > 0 && jobs[i].devvalid && jobs[i].dev == j->dev)
+      return 1;
+  return 0;
 }
 
-static void pu10(void) { printf(" %10s", "?"); }
+static void run_jobs(void) {
+  size_t head=0, end, i;
+  pid_t pid;
+  int status;
 
-#define PTIME(stab, memb)  ((stab) ? ptime((stab), (stab)->memb) : pu10())
+  while (head < njobsq) {
+    end= head + JOBSAHEAD*njobs;
+    if (end > njobsq) end= njobsq;
+    for (i=head; i<end && jobsrunning<njobs; i++)
+      if (!jobs[i].pid && !job_devbusy(&jobs[i],head,end))
+	job_start(&jobs[i]);
 
-static void ptime(const struct stat *stab, uint64_t val) {
-  const char *instead;
+    if (jobs[head].pid == -1) {
+      job_emit(&jobs[head]);
+      free(jobs[head].startpoint);
+      head++;
+      continue;
+    }
 
-  if (!hidextime) goto justprint;
-  else if (S_ISCHR(stab->st_mode)) instead= "char";
-  else if (S_ISBLK(stab->st_mode)) instead= "block";
-  else if (S_ISLNK(stab->st_mode)) instead= "link";
-  else if (S_ISSOCK(stab->st_mode)) instead= "sock";
-  else if (S_ISFIFO(stab->st_mode)) instead= "pipe";
-  else {
-  justprint:
-    printf(" %10" PRIu64 "", val);
-    return;
+    pid= waitpid(-1,&status,0);
+    if (pid<0) { perror("summer: waitpid"); exit(12); }
+    for (i=head; i<end; i++)
+      if (jobs[i].pid == pid) break;
+    if (i>=end) continue;
+    jobs[i].pid= -1;
+    jobs[i].status= status;
+    jobsrunning--;
   }
+}
 
-  printf(" %10s",instead);
+/*
+ * Watching (-w).  We remember, for each directory, the lines we
+ * printed for its entries, and watch it with inotify.  When we next
+ * emit the manifest, a directory which has not changed (and nor has
+ * anything in it) just has its remembered lines replayed, without
+ * even a stat.  Events mark the directory and all its ancestors
+ * dirty, since each directory's own line lives in its parent.
+ * Dirty directories are walked as usual, and the digest cache means
+ * that only files which have changed are read.
+ *
+ * A directory is not remembered if any of its entries is a hardlink
+ * to a non-directory, since a change via another link would not be
+ * noticed; or if we could not watch it.  If the event queue
+ * overflows, or we get SIGHUP, every directory is made dirty.
+ */
+
+#define WATCHMASK (IN_ATTRIB|IN_CLOSE_WRITE|IN_MODIFY|IN_CREATE|IN_DELETE| \
+		   IN_DELETE_SELF|IN_MOVE_SELF|IN_MOVED_FROM|IN_MOVED_TO| \
+		   IN_ONLYDIR|IN_DONT_FOLLOW)
+
+static struct dircache **dircaches, **dcwds;
+static size_t dircaches_size, dircaches_used; /* both sizes; 0 or 2^n */
+static int inotifyfd=-1, watchredo, watchwarned;
+static volatile sig_atomic_t watchsig_emit, watchsig_rescan, watchsig_stop;
+
+static size_t dc_hash(const char *p, size_t l) {
+  uint64_t h= 0xcbf29ce484222325ULL;
+  while (l--) { h ^= (unsigned char)*p++;  h *= 0x100000001b3ULL; }
+  return h;
 }
 
-struct hardlink {
-  dev_t dev;
-  ino_t ino;
-  char path[1];
-};
-static void *hardlinks;
+static struct dircache **dc_chain(const char *p, size_t l) {
+  return &dircaches[dc_hash(p,l) & (dircaches_size-1)];
+}
 
-static int hardlink_compar(const void *av, const void *bv) {
-  const struct hardlink *a=av, *b=bv;
-  if (a->ino != b->ino) return b->ino - a->ino;
-  return b->dev - a->dev;
+static struct dircache **dc_wdchain(int wd) {
+  return &dcwds[(size_t)wd * 0x9e3779b9U & (dircaches_size-1)];
 }
 
-static void recurse(const char *path, unsigned nodeflags, dev_t fs);
+static struct dircache *dc_find(const char *p, size_t l) {
+  struct dircache *dc;
+  if (!dircaches_size) return 0;
+  for (dc= *dc_chain(p,l); dc; dc= dc->next)
+    if (!memcmp(dc->path,p,l) && !dc->path[l]) return dc;
+  return 0;
+}
 
-static void node(const char *path, unsigned nodeflags, dev_t fs) {
-  char linktarg[MAXFN+1];
-  struct hardlink *foundhl;
-  const struct stat *stab;
-  struct stat stabuf;
-  int r, mountpoint=0;
+static struct dircache *dc_findwd(int wd) {
+  struct dircache *dc;
+  if (!dircaches_size) return 0;
+  for (dc= *dc_wdchain(wd); dc; dc= dc->wdnext)
+    if (dc->wd == wd) return dc;
+  return 0;
+}
 
-  r= lstat(path, &stabuf);
-  stab= r ? 0 : &stabuf;
+static void dc_unwd(struct dircache *dc) {
+  struct dircache **dcp;
+  if (dc->wd < 0) return;
+  for (dcp= dc_wdchain(dc->wd); *dcp != dc; dcp= &(*dcp)->wdnext);
+  *dcp= dc->wdnext;
+  dc->wd= -1;
+}
 
-  foundhl= 0;
-  if (stab && stab->st_nlink>1) {
-    struct hardlink *newhl, **foundhl_node;
-    newhl= mmalloc(sizeof(*newhl) + strlen(path));
-    newhl->dev= stab->st_dev;
-    newhl->ino= stab->st_ino;
-    foundhl_node= tsearch(newhl, &hardlinks, hardlink_compar);
-    if (!foundhl_node) malloc_fail();
-    foundhl= *foundhl_node;
-    if (foundhl!=newhl) {
-      free(newhl); /* hardlink to an earlier object */
-    } else {
-      foundhl= 0; /* new object with link count>1 */
-      strcpy(newhl->path, path);
+static void dc_rehash(size_t newsize, int purge) {
+  struct dircache **old= dircaches, *dc, *next, **chain;
+  size_t oldsize= dircaches_size, i;
+
+  dircaches_size= newsize;
+  dircaches= mmalloc(sizeof(*dircaches) * newsize);
+  memset(dircaches, 0, sizeof(*dircaches) * newsize);
+  free(dcwds);
+  dcwds= mmalloc(sizeof(*dcwds) * newsize);
+  memset(dcwds, 0, sizeof(*dcwds) * newsize);
+  dircaches_used= 0;
+
+  for (i=0; i<oldsize; i++) {
+    for (dc= old[i]; dc; dc= next) {
+      next= dc->next;
+      if (purge && dc->gen != watchgen) {
+	if (dc->wd >= 0) inotify_rm_watch(inotifyfd, dc->wd);
+	free(dc->path);  free(dc->items);  free(dc->text);  free(dc->dnames);
+	free(dc);
+	continue;
+      }
+      chain= dc_chain(dc->path, strlen(dc->path));
+      dc->next= *chain;  *chain= dc;
+      if (dc->wd >= 0) {
+	chain= dc_wdchain(dc->wd);
+	dc->wdnext= *chain;  *chain= dc;
+      }
+      dircaches_used++;
     }
   }
+  free(old);
+}
 
-  if (stab) {
-    if ((nodeflags & nodeflag_fsvalid) && stab->st_dev != fs)
-      mountpoint= 1;
-    fs= stab->st_dev;
-    nodeflags |= nodeflag_fsvalid;
-  }
+static struct dircache *dc_get(const char *path) {
+  struct dircache *dc, **chain;
+  size_t l= strlen(path);
 
-  if (!stab) problem_e(path,CSUMXL,"inaccessible");
-  else if (foundhl) csum_str("hardlink");
-  else if (S_ISREG(stab->st_mode)) csum_file(path);
-  else if (S_ISCHR(stab->st_mode)) csum_dev('c',stab);
-  else if (S_ISBLK(stab->st_mode)) csum_dev('b',stab);
-  else if (S_ISFIFO(stab->st_mode)) csum_str("pipe");
-  else if (S_ISLNK(stab->st_mode)) csum_str("symlink");
-  else if (S_ISSOCK(stab->st_mode)) csum_str("sock");
-  else if (S_ISDIR(stab->st_mode)) csum_str(mountpoint ? "mountpoint" : "dir");
-  else problem(path,CSUMXL,"badobj: 0x%lx", (unsigned long)stab->st_mode);
+  dc= dc_find(path,l);
+  if (dc) return dc;
 
-  if (stab && S_ISLNK(stab->st_mode)) {
-    r= readlink(path, linktarg, sizeof(linktarg)-1);
-    if (r==sizeof(linktarg)) { problem(path,-1,"readlink too big"); r=-1; }
-    else if (r<0) { problem_e(path,-1,"readlink"); }
-    else assert(r<sizeof(linktarg));
+  if (dircaches_used >= dircaches_size)
+    dc_rehash(dircaches_size ? dircaches_size*2 : 1024, 0);
+  dc= mmalloc(sizeof(*dc));
+  memset(dc,0,sizeof(*dc));
+  dc->path= mmalloc(l+1);
+  memcpy(dc->path,path,l+1);
+  dc->wd= -1;
+  dc->dirty= 1;
+  chain= dc_chain(path,l);
+  dc->next= *chain;  *chain= dc;
+  dircaches_used++;
+  return dc;
+}
 
-    if (r<0) strcpy(linktarg,"\\?");
-    else linktarg[r]= 0;
+static void dc_watch(struct dircache *dc) {
+  struct dircache *other, **chain;
+  int wd;
+
+  wd= inotify_add_watch(inotifyfd, dc->path, WATCHMASK);
+  if (wd<0) {
+    if (!watchwarned++)
+      fprintf(stderr,"summer: inotify_add_watch: %s"
+	      " (some directories will be reread every time)\n",
+	      strerror(errno));
+    dc->valid= 0;
+    return;
   }
+  other= dc_findwd(wd);
+  if (other == dc) return;
+  if (other) {
+    /* same directory under another name; only one of them can be
+     * told about changes, so the other must be reread every time */
+    dc_unwd(other);
+    other->valid= 0;
+  }
+  dc->wd= wd;
+  chain= dc_wdchain(wd);
+  dc->wdnext= *chain;  *chain= dc;
+}
 
-  if (stab) {
-    if (S_ISDIR(stab->st_mode) && hidedirsize)
-      printf(" %10s","dir");
-    else
-      printf(" %10llu", 
-	     (unsigned long long)stab->st_size);
+/* marks the directory at p, and its ancestors, dirty */
+static void dc_dirty(const char *p, size_t l) {
+  struct dircache *dc;
+  const char *slash;
 
-    printf(" %4o %10ld %10ld",
-	   (unsigned)stab->st_mode & 07777U,
-	   (unsigned long)stab->st_uid,
-	   (unsigned long)stab->st_gid);
-  } else {
-    printf(" %10s %4s %10s %10s", "?","?","?","?");
+  while (l) {
+    dc= dc_find(p,l);
+    if (dc) dc->dirty= 1;
+    slash= memrchr(p,'/',l);
+    if (!slash) break;
+    l= slash - p; /* children of / are //foo, so / itself is found */
   }
+}
 
-  if (!hideatime)
-    PTIME(stab, st_atime);
+static void dc_dirtyall(void) {
+  struct dircache *dc;
+  size_t i;
+  for (i=0; i<dircaches_size; i++)
+    for (dc= dircaches[i]; dc; dc= dc->next)
+      dc->dirty= 1;
+}
 
-  if (!hidemtime) {
-    if (stab && S_ISLNK(stab->st_mode) && hidelinkmtime)
-      printf(" %10s","link");
-    else
-      PTIME(stab, st_mtime);
+static int dc_hardlinksok(const struct dircache *dc) {
+  size_t i;
+  for (i=0; i<dc->nitems; i++)
+    if (dc->items[i].hldir &&
+	hardlink_present(dc->items[i].dev, dc->items[i].ino))
+      return 0;
+  return 1;
+}
+
+/* Called by descend for the directory in pathbuf.  Returns 0 if
+ * it has arranged to replay it, or otherwise the cache to fill. */
+static struct dircache *watch_descend(unsigned nodeflags, dev_t fs) {
+  struct dircache *dc= dc_get(pathbuf);
+  struct dirframe *f;
+
+  dc->gen= watchgen;
+  if (!dc->dirty && dc->valid && dc->wd>=0 && dc_hardlinksok(dc)) {
+    f= dir_push(nodeflags, fs);
+    f->dc= dc;
+    f->replay= 1;
+    return 0;
   }
+  dc->nitems= dc->textlen= dc->dnameslen= 0;
+  dc->dirty= 0;
+  dc->valid= 1;
+  if (dc->wd<0) dc_watch(dc);
+  return dc;
+}
 
-  if (!hidectime)
-    PTIME(stab, st_ctime);
+static void *dc_append(char **buf, size_t *len, size_t *allocd,
+		       const void *p, size_t l) {
+  if (*len + l > *allocd) {
+    *allocd= (*len + l)*2;
+    *buf= mrealloc(*buf, *allocd);
+  }
+  memcpy(*buf + *len, p, l);
+  *len += l;
+  return *buf + *len - l;
+}
 
-  putchar(filenamefieldsep);
-  fn_escaped(stdout, path);
+/* Called after node() for each entry of a directory being read. */
+static void watch_cacheitem(struct dircache *dc, const char *name) {
+  struct dcitem *it;
 
-  if (foundhl) linktargpath(foundhl->path);
-  if (stab && S_ISLNK(stab->st_mode)) linktargpath(linktarg);
+  if (lastnode.uncacheable) dc->valid= 0;
+  if (!dc->valid) return;
+
+  if (dc->nitems >= dc->itemsallocd) {
+    dc->itemsallocd= dc->itemsallocd ? dc->itemsallocd*2 : 16;
+    dc->items= mrealloc(dc->items, sizeof(*dc->items) * dc->itemsallocd);
+  }
+  it= &dc->items[dc->nitems++];
+  it->textoff= dc->textlen;
+  it->textlen= linecap_len;
+  dc_append(&dc->text,&dc->textlen,&dc->textallocd, linecap,linecap_len);
+  it->nameoff= dc->dnameslen;
+  dc_append(&dc->dnames,&dc->dnameslen,&dc->dnamesallocd,
+	    name,strlen(name)+1);
+  it->nodeflags= lastnode.nodeflags;
+  it->fs= lastnode.fs;
+  it->dev= lastnode.dev;
+  it->ino= lastnode.ino;
+  it->hldir= lastnode.hldir;
+  it->descended= lastnode.descended;
+}
 
-  putchar('\n');
+/* Does the next step of replaying the top frame. */
+static void watch_replay(struct dirframe *f) {
+  struct dircache *dc= f->dc;
+  struct dcitem *it;
+  struct digest *dg;
 
+  if (f->next >= dc->nitems) { ascend(); return; }
+  it= &dc->items[f->next++];
+  path_set(f->pathl, dc->dnames + it->nameoff);
+  fwrite(dc->text + it->textoff, 1, it->textlen, stdout);
   if (ferror(stdout)) { perror("summer: stdout"); exit(12); }
 
-  if (stab && S_ISDIR(stab->st_mode) && !(mountpoint && onefilesystem))
-    recurse(path, nodeflags, fs);
+  dg= digest_find(it->dev, it->ino);
+  if (dg) dg->gen= watchgen;
+  if (it->hldir) {
+    if (hardlink_lookup(it->dev, it->ino, pathbuf)) {
+      /* seen already, via some other path; we will have to redo
+       * the whole emission, rereading this directory */
+      dc->dirty= 1;
+      watchredo= 1;
+    }
+  }
+  if (it->descended) descend(it->nodeflags, it->fs, 0);
 }
 
-static void process(const char *startpoint) {
-  if (!quiet)
-    fprintf(stderr,"summer: processing: %s\n",startpoint);
-  node(startpoint, 0,0);
-  tdestroy(hardlinks,free);
-  hardlinks= 0;
+static void watch_events(void) {
+  char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  struct dircache *dc;
+  ssize_t r;
+  char *p;
+
+  for (;;) {
+    r= read(inotifyfd, buf, sizeof(buf));
+    if (r<0) {
+      if (errno==EINTR) continue;
+      if (errno==EAGAIN) return;
+      perror("summer: read inotify"); exit(12);
+    }
+    for (p=buf; p<buf+r; p += sizeof(*ev) + ev->len) {
+      ev= (const void*)p;
+      if (ev->mask & IN_Q_OVERFLOW) { dc_dirtyall(); continue; }
+      dc= dc_findwd(ev->wd);
+      if (!dc) continue;
+      dc_dirty(dc->path, strlen(dc->path));
+      if (ev->mask & IN_IGNORED) { dc_unwd(dc);  dc->valid= 0; }
+    }
+  }
 }
 
-static int recurse_maxlen;
+static void watch_emit(void) {
+  char *tmp;
+  size_t i;
+  int fd, relinked=0;
 
-static int recurse_filter(const struct dirent *de) {
-  int l;
-  if (de->d_name[0]=='.' &&
-      (de->d_name[1]==0 ||
-       (de->d_name[1]=='.' &&
-	de->d_name[2]==0)))
-    return 0;
-  l= strlen(de->d_name);
-  if (l > recurse_maxlen) recurse_maxlen= l;
-  return 1;
+  tmp= mmalloc(strlen(watchout)+5);
+  sprintf(tmp,"%s.new",watchout);
+
+  do {
+    fd= open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd<0) { perror("summer: create output"); exit(12); }
+    if (fflush(stdout) || dup2(fd,1)<0) { perror("summer: dup2"); exit(12); }
+    close(fd);
+
+    watchgen++;
+    watchredo= watchnewlink= 0;
+    for (i=0; i<njobsq; i++)
+      process(jobs[i].startpoint);
+    if (watchnewlink && watchgen>1 && !relinked++) {
+      dc_dirtyall();
+      watchredo= 1;
+    }
+    if (ferror(stdout) || fflush(stdout)) {
+      perror("summer: output"); exit(12);
+    }
+  } while (watchredo);
+
+  if (rename(tmp,watchout)) { perror("summer: install output"); exit(12); }
+  free(tmp);
+  if (profiling) prof_report();
+
+  dc_rehash(dircaches_size, 1);
+  digests_rebuild(digests_size, 1);
 }
 
-static int recurse_compar(const struct dirent **a, const struct dirent **b) {
-  return strcmp((*a)->d_name, (*b)->d_name);
+static void watch_signal(int sig) {
+  switch (sig) {
+  case SIGUSR1: watchsig_emit= 1; break;
+  case SIGHUP: watchsig_rescan= 1; break;
+  default: watchsig_stop= 1; break;
+  }
 }
 
-static void recurse(const char *path_or_buf, unsigned nodeflags, dev_t fs) {
-  static char *buf;
-  static int buf_allocd;
-  
-  struct dirent **namelist, *const *de;
-  const char *path_or_0= path_or_buf==buf ? 0 : path_or_buf;
-  int nentries, pathl, esave, buf_want, i;
+static void watch_run(void) {
+  static const int sigs[]= { SIGUSR1, SIGHUP, SIGTERM, SIGINT };
+  struct timespec now, next, ts;
+  struct sigaction sa;
+  sigset_t block, orig;
+  struct pollfd pfd;
+  size_t i;
+  int r;
 
-  pathl= strlen(path_or_buf);
-  recurse_maxlen= 2;
-  nentries= scandir(path_or_buf, &namelist, recurse_filter, recurse_compar);
-  esave= errno;
-  
-  buf_want= pathl+1+recurse_maxlen+1;
-  if (buf_want > buf_allocd) {
-    buf= mrealloc(buf, buf_want);
-    buf_allocd= buf_want;
-  }
-  /* NOTE that path_or_buf is invalid after this point because
-   * it might have been realloc'd ! */
-  if (path_or_0) strcpy(buf,path_or_0);
-
-  buf[pathl]= '/';
-  pathl++;
-  if (nentries < 0) {
-    buf[pathl]= 0;  errno= esave;
-    problem_e(buf,CSUMXL+72,"scandir failed");
-    fn_escaped(stdout,buf);  putchar('\n');
-    return;
+  inotifyfd= inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (inotifyfd<0) { perror("summer: inotify_init1"); exit(12); }
+
+  sigemptyset(&block);
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler= watch_signal;
+  sigemptyset(&sa.sa_mask);
+  for (i=0; i<sizeof(sigs)/sizeof(sigs[0]); i++) {
+    sigaddset(&block, sigs[i]);
+    if (sigaction(sigs[i],&sa,0)) { perror("summer: sigaction"); exit(12); }
   }
-  for (i=0, de=namelist; i<nentries; i++, de++) {
-    strcpy(buf+pathl, (*de)->d_name);
-    node(buf, nodeflags, fs);
-    free(*de);
+  if (sigprocmask(SIG_BLOCK,&block,&orig)) {
+    perror("summer: sigprocmask"); exit(12);
+  }
+
+  watch_emit();
+  clock_gettime(CLOCK_MONOTONIC,&next);
+  next.tv_sec += watchinterval;
+
+  while (!watchsig_stop) {
+    if (watchsig_rescan) { watchsig_rescan= 0;  dc_dirtyall(); }
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    if (watchsig_emit || (watchinterval && now.tv_sec >= next.tv_sec)) {
+      watchsig_emit= 0;
+      watch_events();
+      watch_emit();
+      clock_gettime(CLOCK_MONOTONIC,&next);
+      next.tv_sec += watchinterval;
+      continue;
+    }
+    ts.tv_sec= next.tv_sec - now.tv_sec;
+    ts.tv_nsec= 0;
+    pfd.fd= inotifyfd;
+    pfd.events= POLLIN;
+    r= ppoll(&pfd,1, watchinterval ? &ts : 0, &orig);
+    if (r<0 && errno!=EINTR) { perror("summer: ppoll"); exit(12); }
+    if (r>0) watch_events();
   }
-  free(namelist);
+}
+
+static void startpoint(const char *sp) {
+  if (njobs || watchout) job_add(sp);
+  else process(sp);
 }
 
 static void from_stdin(void) {
@@ -377,12 +2235,49 @@ static void from_stdin(void) {
     assert(l>0);
     if (buf[l-1]!='\n') { fprintf(stderr,"summer: line too long\n"); exit(8); }
     buf[l-1]= 0;
-    process(buf);
+    startpoint(buf);
+  }
+}
+
+static void badusage(void) {
+  fprintf(stderr,"summer: bad usage, try -h\n");
+  exit(8);
+}
+
+/* Value of an option taking an argument: the rest of this word,
+ * or else the next word. */
+static const char *optvalue(const char **arg_io,
+			    const char *const **argv_io) {
+  const char *r= *arg_io;
+
+  if (!*r) {
+    r= (*argv_io)[2];
+    if (!r) badusage();
+    (*argv_io)++;
+  }
+  *arg_io= "";
+  return r;
+}
+
+static void bin_open(const char *binpath) {
+  int fd;
+
+  if (!strcmp(binpath,"-")) {
+    /* binary manifest instead of the text one, which we don't make */
+    fd= dup(1);
+    if (fd<0 || !(binout= fdopen(fd,"wb")))
+      { perror("summer: redirect stdout for manifest"); exit(12); }
+    notext= 1;
+  } else {
+    binout= fopen(binpath,"wb");
+    if (!binout) { perror("summer: open manifest"); exit(12); }
   }
+  mf_start(&binw, binout);
 }
 
 int main(int argc, const char *const *argv) {
-  const char *arg;
+  const char *arg, *binpath=0, *chunkpath=0;
+  char *ep;
   int c;
 
   errfile= stderr;
@@ -393,7 +2288,9 @@ int main(int argc, const char *const *argv) {
       case 'h':
 	fprintf(stderr,
 		"summer: usage: summer startpoint... >data.list\n"
-		"               cat startpoints.list | summer >data.list\n");
+		"               cat startpoints.list | summer >data.list\n"
+		"               summer -m data.bin startpoint... >data.list\n"
+		"               summer -w data.list [-i secs] startpoint...\n");
 	exit(8);
       case 'q':
 	quiet= 1;
@@ -425,26 +2322,129 @@ int main(int argc, const char *const *argv) {
       case 'f':
 	errfile= stdout;
 	break;
+      case 'O':
+	directio= 1;
+	break;
+      case 'N':
+	dropcache= 1;
+	break;
+      case 'm':
+	binpath= optvalue(&arg,&argv);
+	break;
+      case 'T':
+	treehash= 1;
+	break;
+      case 'a':
+	showalloc= 1;
+	break;
+      case 'j':
+	njobs= strtoul(optvalue(&arg,&argv), &ep, 10);
+	if (*ep || njobs<1) badusage();
+	break;
+      case 'k':
+	chunkpath= optvalue(&arg,&argv);
+	break;
+      case 'K':
+	chunkthreshold= strtoull(optvalue(&arg,&argv), &ep, 0);
+	if (*ep) badusage();
+	break;
+      case 'w':
+	watchout= optvalue(&arg,&argv);
+	break;
+      case 'P':
+	profiling= 1;
+	break;
+      case 'e':
+	exclude_add(0, optvalue(&arg,&argv));
+	break;
+      case 'E':
+	exclude_add(1, optvalue(&arg,&argv));
+	break;
+      case 'X':
+	exclude_file(optvalue(&arg,&argv));
+	break;
+      case 'S':
+	showexcluded= 1;
+	break;
+      case 'W':
+	showbtime= 1;
+	break;
+      case 'n':
+	nsectimes= 1;
+	timewidth= 20;
+	break;
+      case 'F':
+	statxsync= AT_STATX_DONT_SYNC;
+	break;
+      case 'H':
+	hashes_set(optvalue(&arg,&argv));
+	break;
+      case 'i':
+	watchinterval= strtoul(optvalue(&arg,&argv), &ep, 10);
+	if (*ep) badusage();
+	break;
       default:
-	fprintf(stderr,"summer: bad usage, try -h\n");
-	exit(8);
+	badusage();
       }
     }
     argv++;
   }
 
+  if (treehash && !binpath) {
+    fprintf(stderr,"summer: -T requires -m\n");
+    exit(8);
+  }
+  if (watchout) {
+    if (binpath || chunkpath || njobs) {
+      fprintf(stderr,"summer: -w cannot be combined with -m, -k or -j\n");
+      exit(8);
+    }
+    errfile= stdout;
+  }
+  statxmask= STATX_TYPE|STATX_MODE|STATX_NLINK|STATX_UID|STATX_GID|
+    STATX_INO|STATX_SIZE|STATX_BLOCKS;
+  if (!hideatime) statxmask |= STATX_ATIME;
+  if (!hidemtime || watchout) statxmask |= STATX_MTIME;
+  if (!hidectime || watchout) statxmask |= STATX_CTIME;
+  if (showbtime) statxmask |= STATX_BTIME;
+
+  if (profiling) {
+    prof_t0= prof_now();
+    if (!watchout) signal(SIGUSR1, prof_signal);
+  }
+  if (binpath) bin_open(binpath);
+  setvbuf(stdout, 0, _IOFBF, OUTBUFSZ);
+  if (chunkpath) {
+    chunkout= fopen(chunkpath,"w");
+    if (!chunkout) { perror("summer: open chunk file"); exit(12); }
+    chunk_setup();
+  }
+
   if (!argv[1]) {
     from_stdin();
   } else {
     if (!quiet)
       fprintf(stderr, "summer: processing command line args as startpoints\n");
     while ((arg=*++argv)) {
-      process(arg);
+      startpoint(arg);
     }
   }
+  if (njobs) run_jobs();
+  if (watchout) watch_run();
   if (ferror(stdout) || fclose(stdout)) {
     perror("summer: stdout (at end)"); exit(12);
   }
+  if (chunkout && (ferror(chunkout) || fclose(chunkout))) {
+    perror("summer: chunk file (at end)"); exit(12);
+  }
+  if (binout) {
+    mf_finish(&binw);
+    if (ferror(binout) || fclose(binout)) {
+      perror("summer: manifest (at end)"); exit(12);
+    }
+  }
+  if (!njobs) walk_report();
+  if (profiling && !njobs) prof_report();
   if (!quiet)
     fputs("summer: done.\n", stderr);
   return 0;
@@ -13,9 +13,11 @@ our @EXPORT = qw(
 use strict;
 
 use Carp;
+use Digest::SHA qw(sha256_hex);
 use Fcntl qw(F_GETFL F_SETFL O_NONBLOCK);
 use IO::FDPass;
 use POSIX qw(_exit setsid :sys_wait_h :errno_h :signal_h);
+use Socket qw(AF_UNIX SOCK_STREAM PF_UNSPEC);
 use Sys::Syslog qw(openlog syslog LOG_INFO LOG_ERR LOG_WARNING);
 use Time::HiRes qw();
 
@@ -24,11 +26,28 @@ our $logger;
 our $env_name = 'PREFORK_INTERP';
 
 our @call_fds;
+our $call_data;
 our $socket_path;
 our $fail_log = 0;
 our $startup_mtime;
+our $env_baseline_hash;
+our %env_baseline;     # %ENV as each call's monitor starts out with it
+our $server_pid;
+our $status_resend_full_env = 0xffffffff;
+
+# Adjustment of the concurrency limit
+our $adapt_interval = 0.5;        # seconds between adjustments
+our $memory_pressure_max = 10;    # PSI memory "some" avg10, %
+our $memory_available_min = 0.05; # fraction of MemTotal
+our ($limit, $limit_min, $limit_max, $limit_target);
+our ($adapt_next, @cpu_last);
+
+our $trace_env_name = 'PREFORK_INTERP_TRACE';
+our $trace;           # if tracing this call, items to send after the status
+our $accept_time;
 
 our @autoreload_extra_files = ();
+our @autoreload_stat_files;  # files the watcher isn't watching for us
 
 sub prefork_autoreload_also_check {
   push @autoreload_extra_files, @_;
@@ -44,6 +63,92 @@ sub fail_log ($) {
   _exit 127;
 }
 
+sub trace_now () {
+  sprintf "%.0f",
+    Time::HiRes::clock_gettime(Time::HiRes::CLOCK_MONOTONIC()) * 1e9;
+}
+
+sub trace_stamp ($) {
+  my ($k) = @_;
+  $trace .= "$k=".trace_now()."\0" if defined $trace;
+}
+
+sub cpu_count () {
+  open S, '<', '/proc/stat' or return 1;
+  my $n = grep { m/^cpu\d/ } <S>;
+  close S;
+  return $n || 1;
+}
+
+# Returns how many CPUs' worth were idle since the last call,
+# or undef if we can't tell.
+sub cpu_idle ($) {
+  my ($ncpus) = @_;
+  open S, '<', '/proc/stat' or return undef;
+  my @f = split ' ', scalar <S>;
+  close S;
+  shift @f;
+  my $idle = $f[3] + ($f[4] // 0);
+  my $total = 0;
+  $total += $_ foreach @f[0..($#f < 7 ? $#f : 7)];
+  my @last = @cpu_last;
+  @cpu_last = ($idle, $total);
+  return undef unless @last && $total > $last[1];
+  return $ncpus * ($idle - $last[0]) / ($total - $last[1]);
+}
+
+sub memory_pressured () {
+  if (open P, '<', '/proc/pressure/memory') {
+    my $l = <P>;
+    close P;
+    return 1 if $l =~ m/^some avg10=([\d.]+)/ && $1 > $memory_pressure_max;
+  }
+  open M, '<', '/proc/meminfo' or return 0;
+  my %m;
+  while (<M>) { $m{$1} = $2 if m/^(\w+):\s*(\d+)/; }
+  close M;
+  return $m{MemTotal} && defined $m{MemAvailable} &&
+    $m{MemAvailable} < $m{MemTotal} * $memory_available_min;
+}
+
+sub listen_pending () {
+  my $rbits = '';
+  vec($rbits, fileno(LISTEN), 1) = 1;
+  return select($rbits, '', '', 0) > 0;
+}
+
+# Every $adapt_interval, perhaps moves $limit: up if calls are
+# waiting and there is a CPU to spare, down (fast) under memory
+# pressure, and otherwise back towards the target.
+sub concurrency_adapt ($$) {
+  my ($busy, $ncpus) = @_;
+  my $now = Time::HiRes::time();
+  return if defined $adapt_next && $now < $adapt_next;
+  $adapt_next = $now + $adapt_interval;
+
+  my $idle = cpu_idle($ncpus);
+  my ($new, $why) = ($limit);
+  if (memory_pressured()) {
+    $new = int($limit / 2);
+    $why = 'memory pressure';
+  } elsif ($busy >= $limit && listen_pending() &&
+	   (!defined $idle || $idle >= 0.5)) {
+    $new = $limit + 1;
+    $why = 'calls waiting, CPU idle';
+  } elsif ($busy < $limit && $limit > $limit_target) {
+    $new = $limit - 1;
+    $why = 'load fell';
+  } elsif ($limit < $limit_target) {
+    $new = $limit + 1;
+    $why = 'memory pressure eased';
+  }
+  $new = $limit_min if $new < $limit_min;
+  $new = $limit_max if $new > $limit_max;
+  return if $new == $limit;
+  syslog(LOG_INFO, "$0 prefork: concurrency limit $new (was $limit): $why");
+  $limit = $new;
+}
+
 sub server_quit ($) {
   my ($m) = @_;
   syslog(LOG_INFO, "$0 prefork: $m, quitting");
@@ -51,56 +156,267 @@ sub server_quit ($) {
 }
 
 # Returns in the executor process
-sub become_monitor () {
+sub become_monitor ($) {
+  my ($initial) = @_;
   close LISTEN;
   close WATCHI;
   close WATCHE;
+  close_spare_fds();
+  $SIG{CHLD} = 'DEFAULT';
 
   # Make a process group for this call
   setpgrp or fail_log("setpgrp failed: $!");
 
-  eval { protocol_exchange(); 1; }
+  eval { protocol_exchange($initial); 1; }
     or fail_log("protocol exchange failed: $@");
 
   pipe EXECTERM, EXECTERMW or fail_log("pipe: $!");
 
+  trace_stamp('fork');
   my $child = fork // fail_log("fork executor: $!");
   if (!$child) {
     #---- executor ----
-    open ::STDIN , "<& $call_fds[0]" or fail_log("dup for fd0");
-    open ::STDOUT, ">& $call_fds[1]" or fail_log("dup for fd1");
-    open ::STDERR, ">& $call_fds[2]" or fail_log("dup for fd2");
     close EXECTERM;
-    close_call_fds();
-    $! = 0;
+    become_executor();
     return;
   }
   close EXECTERMW;
+  foreach (@call_fds) {
+    POSIX::close($_);
+  }
 
-  #---- monitor [2] ----
+  monitor_calls($child);
+}
+
+# Returns in the executor process
+sub become_spare_monitor ($) {
+  my ($opts) = @_;
+  close WATCHI;
+  close WATCHE;
+  close SPAREW;
+  close BUSYR;
+  close CHLDR;
+  close CHLDW;
+  $SIG{CHLD} = 'DEFAULT';
+
+  setpgrp or fail_log("setpgrp failed: $!");
+
+  my $child;
+  if ($opts->{spare_executors} // 1) {
+    # Fork the executor now, too; it waits for us to pass it the call
+    pipe EXECTERM, EXECTERMW or fail_log("pipe: $!");
+    socketpair EXECCALL, EXECCALLM, AF_UNIX, SOCK_STREAM, PF_UNSPEC
+      or fail_log("socketpair: $!");
+    $child = fork // fail_log("fork spare executor: $!");
+    if (!$child) {
+      #---- executor (spare) ----
+      $0 =~ s{ \[monitor\]$}{ [executor]};
+      close EXECTERM;
+      close EXECCALLM;
+      close LISTEN;
+      close SPARER;
+      close BUSYW;
+      eval { executor_receive(); 1; }
+	or fail_log("receive call from monitor failed: $@");
+      become_executor();
+      return;
+    }
+    close EXECTERMW;
+    close EXECCALL;
+  }
+
+  #---- monitor (spare) ----
 
   for (;;) {
     my $rbits = '';
+    vec($rbits, fileno(LISTEN), 1) = 1;
+    vec($rbits, fileno(SPARER), 1) = 1;
+    vec($rbits, fileno(EXECTERM), 1) = 1 if $child;
+    my $ebits = $rbits;
+    my $nfound = select($rbits, '', $ebits, undef);
+    if ($nfound < 0) {
+      next if $! == EINTR;
+      fail_log("spare monitor select() failed: $!");
+    }
+    # Server has gone away; our executor will see EOF and exit too
+    _exit(0) if vec($rbits, fileno(SPARER), 1);
+    fail_log("spare executor [$child] died")
+      if $child && vec($rbits, fileno(EXECTERM), 1);
+    if (accept(CALL, LISTEN)) {
+      $accept_time = trace_now();
+      last;
+    }
+    next if $! == EINTR || $! == EAGAIN || $! == EWOULDBLOCK;
+    fail_log("accept failed: $!");
+  }
+
+  #---- monitor [1] ----
+
+  close LISTEN;
+  close SPARER;
+  syswrite BUSYW, pack "N", $$;
+  close BUSYW;
+
+  # The server checks this too, but not before every accept
+  autoreload_check_all();
+
+  eval { protocol_exchange(0); 1; }
+    or fail_log("protocol exchange failed: $@");
+
+  trace_stamp('fork');
+  if ($child) {
+    foreach (@call_fds) {
+      IO::FDPass::send(fileno(EXECCALLM), $_)
+	or fail_log("pass fd to executor: $!");
+    }
+    (print EXECCALLM pack("N", length $call_data), $call_data
+     and close EXECCALLM)
+      or fail_log("pass call to executor: $!");
+    foreach (@call_fds) {
+      POSIX::close($_);
+    }
+  } else {
+    pipe EXECTERM, EXECTERMW or fail_log("pipe: $!");
+    $child = fork // fail_log("fork executor: $!");
+    if (!$child) {
+      #---- executor ----
+      close EXECTERM;
+      become_executor();
+      return;
+    }
+    close EXECTERMW;
+    foreach (@call_fds) {
+      POSIX::close($_);
+    }
+  }
+
+  monitor_calls($child);
+}
+
+# Waits for the call the executor $child is running, and then deals
+# with any further calls the caller makes on the same connection.
+# Returns in the executor process (for a further call).
+sub monitor_calls ($) {
+  my ($child) = @_;
+
+  for (;;) {
+    monitor_wait($child);
+
+    #---- monitor [3] ----
+
+    %ENV = %env_baseline;
+    undef $trace;
+    undef $accept_time;
+    $SIG{INT} = 'DEFAULT';
+
+    eval { protocol_receive(); 1; }
+      or fail_log("protocol exchange failed: $@");
+
+    pipe EXECTERM, EXECTERMW or fail_log("pipe: $!");
+
+    trace_stamp('fork');
+    $child = fork // fail_log("fork executor: $!");
+    if (!$child) {
+      #---- executor ----
+      close EXECTERM;
+      become_executor();
+      return;
+    }
+    close EXECTERMW;
+    foreach (@call_fds) {
+      POSIX::close($_);
+    }
+  }
+}
+
+sub become_executor () {
+  open ::STDIN , "<& $call_fds[0]" or fail_log("dup for fd0");
+  open ::STDOUT, ">& $call_fds[1]" or fail_log("dup for fd1");
+  open ::STDERR, ">& $call_fds[2]" or fail_log("dup for fd2");
+  close_call_fds();
+  if (length($ENV{$trace_env_name} // '')) {
+    # The monitor passes this on with the status
+    syswrite EXECTERMW, "exec=".trace_now()."\0";
+  }
+  $! = 0;
+}
+
+# In a spare executor: receives what the monitor got from the caller
+sub executor_receive () {
+  @call_fds = map {
+    my $r;
+    for (;;) {
+      $! = 0;
+      $r = IO::FDPass::recv(fileno(EXECCALL));
+      last if $r >= 0;
+      _exit(0) if $!==0;
+      next if $!==EINTR;
+      die("recv fd $_: $!");
+    }
+    $r;
+  } 0..2;
+
+  my $len;
+  my $r = read(EXECCALL, $len, 4) // die("read call length: $!");
+  $r == 4 or die("short read of call length");
+  $len = unpack "N", $len;
+  $r = read(EXECCALL, $call_data, $len) // die("read call data: $!");
+  $r == $len or die("short read of call data");
+  close EXECCALL;
+  call_data_apply();
+}
+
+sub monitor_wait ($) {
+  my ($child) = @_;
+
+  #---- monitor [2] ----
+
+  my $rbits;
+  for (;;) {
+    $rbits = '';
     vec($rbits, fileno(CALL), 1) = 1;
     vec($rbits, fileno(EXECTERM), 1) = 1;
     my $ebits = $rbits;
     my $nfound = select($rbits, '', $ebits, undef);
-    last if $nfound > 0;
+    if ($nfound > 0) {
+      last unless vec($rbits, fileno(EXECTERM), 1);
+      # The executor may have sent us trace items; otherwise it's EOF
+      my $r = sysread EXECTERM, my $items, 4096;
+      if ($r) {
+	$trace .= $items if defined $trace;
+	next;
+      }
+      last if defined $r || $! != EINTR;
+      next;
+    }
     next if $! == EINTR;
     fail_log("monitor select() failed: $!");
   }
 
-  # Either the child has just died, or the caller has gone away
+  # Either the child has just died, or the caller has gone away.
+  # If the child has died we must reap it before killing the rest of
+  # the process group, or we might kill it while it is still exiting.
 
-  $SIG{INT} = 'IGN';
-  kill 'INT', 0 or fail_log("kill executor [$child]: $!");
+  $SIG{INT} = 'IGNORE';
+  if (!vec($rbits, fileno(EXECTERM), 1)) {
+    kill 'INT', 0 or fail_log("kill executor [$child]: $!");
+  }
 
   my $got = waitpid $child, 0;
-  $got >= 0 // fail_log("wait for executor [$child] (2): $!");
+  $got >= 0 or fail_log("wait for executor [$child] (2): $!");
   $got == $child or fail_log("wait for esecutor [$child] gave [$got]");
-
-  protocol_write(pack "N", $?);
-  _exit(0);
+  my $status = $?;
+
+  kill 'INT', 0 or fail_log("kill process group: $!");
+
+  my $reply = pack "N", $status;
+  $reply .= pack("N", length $trace).$trace if defined $trace;
+  # We can take another call, unless the server has gone (eg to
+  # reload), in which case the caller must connect afresh
+  my $more = getppid() == $server_pid;
+  $reply .= protocol_greeting(0) if $more;
+  protocol_write($reply);
+  _exit(0) unless $more;
 }
 
 sub close_call_fds () {
@@ -110,6 +426,15 @@ sub close_call_fds () {
   close CALL;
 }
 
+sub close_spare_fds () {
+  close SPARER;
+  close SPAREW;
+  close BUSYR;
+  close BUSYW;
+  close CHLDR;
+  close CHLDW;
+}
+
 sub protocol_write ($) {
   my ($d) = @_;
   return if (print CALL $d and flush CALL);
@@ -133,15 +458,28 @@ sub protocol_read_fail ($) {
   die("recv $what: $!");
 }
 
-sub protocol_exchange () {
-  my $greeting = "PFI\n\0\0\0\0";
-  protocol_write($greeting);
+# Only the client which spawned us can be relied on to understand
+# xdata, and only it needs the envhash; the rest get it from e<ident>
+sub protocol_greeting ($) {
+  my ($initial) = @_;
+  my $xdata = '';
+  $xdata .= "envhash=$env_baseline_hash\0"
+    if $initial && defined $env_baseline_hash;
+  return "PFI\n".(pack "N", length $xdata).$xdata;
+}
+
+sub protocol_exchange ($) {
+  my ($initial) = @_;
+  protocol_write(protocol_greeting($initial));
+  protocol_receive();
+}
 
+sub protocol_receive () {
   my $ibyte = 0;
   my $r;
   for (;;) {
     $r = sysread CALL, $ibyte, 1;
-    last if $r > 0;
+    last if defined $r;
     $!==EINTR or protocol_read_fail("signalling byte");
   }
   $r == 1 or _exit(0);
@@ -165,19 +503,51 @@ sub protocol_exchange () {
   $r == 4 or _exit(0);
 
   $len = unpack "N", $len;
-  my $data;
-  $r = read(CALL, $data, $len) // protocol_read_fail("message data ($len)");
+  $r = read(CALL, $call_data, $len) // protocol_read_fail("message data ($len)");
   $r == $len or _exit(0);
 
-  @ARGV = split /\0/, $data, -1;
+  if (!call_data_apply()) {
+    # Client sent a delta from some other baseline
+    protocol_write(pack "N", $status_resend_full_env);
+    _exit(0);
+  }
+
+  if (length($ENV{$trace_env_name} // '')) {
+    $trace = '';
+    $trace .= "accept=$accept_time\0" if defined $accept_time;
+    trace_stamp('received');
+  }
+}
+
+# Sets @ARGV and %ENV from $call_data
+# Returns false if it is a delta from a baseline other than ours.
+# If it is a delta, %ENV must still be our baseline.
+sub call_data_apply () {
+  @ARGV = split /\0/, $call_data, -1;
   @ARGV >= 2 or die("message data has too few strings (".(scalar @ARGV).")");
   length(pop(@ARGV)) and die("message data missing trailing nul");
+  if ($ARGV[0] =~ m/^=/) {
+    my $hash = $';
+    return 0 unless defined $env_baseline_hash && $hash eq $env_baseline_hash;
+    shift @ARGV;
+    delete $ENV{$env_name};
+    while (defined(my $s = shift @ARGV)) {
+      last if !length $s;
+      if ($s =~ m/=/) {
+	$ENV{$`} = $';
+      } else {
+	delete $ENV{$s};
+      }
+    }
+    return 1;
+  }
   %ENV = ();
   while (my $s = shift @ARGV) {
     last if !length $s;
     $s =~ m/=/ or die("message data env var missing equals");
     $ENV{$`} = $';
   }
+  return 1;
 }
 
 sub autoreload_check ($) {
@@ -193,6 +563,46 @@ sub autoreload_check ($) {
   }
 }
 
+sub autoreload_files ($) {
+  my ($opts) = @_;
+  return
+    (($opts->{autoreload_inc} // 1) ? (grep { defined } values %INC) : ()),
+    @autoreload_extra_files,
+    @{ $opts->{autoreload_extra} // [] };
+}
+
+sub autoreload_check_all () {
+  foreach my $f (@autoreload_stat_files) {
+    autoreload_check($f);
+  }
+}
+
+# Hands the files over to the watcher, if it can watch them.  It tells
+# us on WATCHE about any it can't, and then we stat those ourselves.
+sub autoreload_setup ($$) {
+  my ($opts, $watch) = @_;
+  my @files = autoreload_files($opts);
+  if (!$watch) {
+    @autoreload_stat_files = @files;
+    return;
+  }
+  @autoreload_stat_files = ();
+  # An empty name asks the watcher to do reloads warm
+  my $data = join '',
+    ($opts->{autoreload_warm} ? "\0" : ()),
+    map { "$_\0" } @files;
+  local $SIG{PIPE} = 'IGNORE'; # if the watcher's gone, we'll see EOF
+  while (length $data) {
+    my $r = syswrite WATCHI, $data;
+    if (!defined $r) {
+      next if $! == EINTR;
+      last if $! == EPIPE;
+      fail_log("write to watcher: $!");
+    }
+    substr($data, 0, $r) = '';
+  }
+}
+
 sub prefork_initialisation_complete {
   my %opts = @_;
 
@@ -208,7 +618,33 @@ sub prefork_initialisation_complete {
   croak "$env_name has too few fds" unless @env_fds >= 4;;
   $#env_fds = 3;
 
-  my $num_servers = $opts{max_servers} // 4;
+  # Clients older than v2 misread a greeting with any xdata
+  if (($opts{env_delta} // 1) && grep { $_ eq 'v2' } @vsns[2..$#vsns]) {
+    # Calls may send only how their environment differs from this.
+    # The client checks that it has the same idea of it as we do.
+    my %baseline = %ENV;
+    delete $baseline{$env_name};
+    $env_baseline_hash = sha256_hex
+      join '', map { "$_=$baseline{$_}\0" } sort keys %baseline;
+  }
+
+  my $ncpus = cpu_count();
+  $limit_max = $opts{max_servers} // ($ncpus > 2 ? 2 * $ncpus : 4);
+  $limit_target = $opts{target_servers} // $opts{max_servers} // 4;
+  $limit_min = $opts{min_servers} // 1;
+  if ($limit_max >= 0) {
+    $limit_target = $limit_max if $limit_target > $limit_max;
+    $limit_min = $limit_target if $limit_min > $limit_target;
+    $limit_min = 1 if $limit_min < 1;
+    $limit_target = $limit_min if $limit_target < $limit_min;
+    $limit_max = $limit_target if $limit_max < $limit_target;
+    $limit = $limit_target;
+  } else {
+    $limit = -1;
+  }
+  my $num_spares = $opts{spare_servers} // 1;
+  $num_spares = $limit_max
+    if $limit_max >= 0 && $num_spares > $limit_max;
 
   #---- setup (pm) [1] ----
 
@@ -240,14 +676,18 @@ sub prefork_initialisation_complete {
 
   #---- server(pm) [1] ----
 
+  $server_pid = $$;
+  %env_baseline = %ENV;
   $child = fork // croak "second fork failed: $!";
   if (!$child) {
     # we are the child, i.e. the one fa-monitor
     local $0 = "$0 [monitor(init)]";
-    return become_monitor();
+    return become_monitor(1);
   }
   close CALL;
 
+  autoreload_setup(\%opts, scalar grep { $_ eq 'watch' } @vsns[2..$#vsns]);
+
   our %children;
   $children{$child} = 1;
   
@@ -262,17 +702,40 @@ sub prefork_initialisation_complete {
   close NULL;
 
   my $errcount = 0;
+  my $max_errors = $opts{max_errors} // 100;
+  my $draining = 0;
+  my $last_call = Time::HiRes::time(); # for the idle timeout
+  my $watchbuf = ''; # partial line from the watcher
+
+  # Spare monitors wait for calls themselves.  They see EOF on SPARER
+  # when we exit, and tell us on BUSYW when they have accepted a call.
+  if ($num_spares) {
+    pipe SPARER, SPAREW or fail_log("pipe for spares: $!");
+    pipe BUSYR, BUSYW or fail_log("pipe for spares: $!");
+  }
+
+  # We don't block in waitpid, since we want to see calls waiting
+  # even when we are at the limit; instead SIGCHLD wakes our select.
+  pipe CHLDR, CHLDW or fail_log("pipe for SIGCHLD: $!");
+  foreach my $fh (\*CHLDR, \*CHLDW) {
+    my $fl = fcntl($fh, F_GETFL, 0) // fail_log("F_GETFL: $!");
+    fcntl($fh, F_SETFL, $fl | O_NONBLOCK) // fail_log("F_SETFL: $!");
+  }
+  $SIG{CHLD} = sub { syswrite CHLDW, 'c'; };
 
   for (;;) {
     # reap children
     if (%children) {
-      my $full = $num_servers >= 0 ? %children >= $num_servers : 0;
-      my $got = waitpid -1, ($full ? 0 : WNOHANG);
+      my $got = waitpid -1, WNOHANG;
       $got >= 0 or fail_log("failed to wait for monitor(s): $!");
       if ($got) {
 	if ($? && $? != SIGPIPE) {
 	  syslog(LOG_WARNING,
  "$0 prefork: monitor process [$got] failed with wait status $?");
+	  if (($children{$got} // '') eq 'spare' &&
+	      ++$errcount > $max_errors) {
+	    fail_log("too many spare monitor failures, quitting");
+	  }
 	}
 	if (!exists $children{$got}) {
 	  syslog(LOG_WARNING,
@@ -283,56 +746,130 @@ sub prefork_initialisation_complete {
       }
     }
 
+    my $busy = grep { $_ ne 'spare' } values %children;
+    concurrency_adapt($busy, $ncpus) if $limit >= 0;
+    my $full = $limit >= 0 && $busy >= $limit;
+
+    # top up the spare monitors
+    if ($num_spares) {
+      my $spares = grep { $_ eq 'spare' } values %children;
+      while ($spares < $num_spares &&
+	     !($limit >= 0 && %children >= $limit)) {
+	$child = fork // fail_log("fork spare monitor failed: $!");
+	if (!$child) {
+	  $0 =~ s{ \[server\]$}{ [monitor]};
+	  return become_spare_monitor(\%opts);
+	}
+	$children{$child} = 'spare';
+	$spares++;
+      }
+    }
+
     # select for accepting or housekeeping timeout
     my $rbits = '';
-    vec($rbits, fileno(LISTEN), 1) = 1;
-    vec($rbits, fileno(WATCHE), 1) = 1;
+    if ($num_spares) {
+      vec($rbits, fileno(BUSYR), 1) = 1;
+    } elsif (!$full) {
+      vec($rbits, fileno(LISTEN), 1) = 1;
+    }
+    vec($rbits, fileno(WATCHE), 1) = 1 unless $draining;
+    vec($rbits, fileno(CHLDR), 1) = 1;
     my $ebits = $rbits;
     my $idle_timeout = $opts{idle_timeout} // 1000000;
     $idle_timeout = undef if $idle_timeout < 0;
-    my $nfound = select($rbits, '', $ebits, $idle_timeout);
-
-    # Idle timeout?
-    last if $nfound == 0;
+    my $adapting = $limit >= 0 && ($full || $limit != $limit_target);
+    # Waking up to adapt the limit mustn't postpone the idle timeout
+    my $timeout = $idle_timeout;
+    if (defined $timeout) {
+      $timeout -= Time::HiRes::time() - $last_call;
+      $timeout = 0 if $timeout < 0;
+    }
+    $timeout = $adapt_interval
+      if $adapting && !(defined $timeout && $timeout < $adapt_interval);
+    $timeout = 0 if $draining && !$full;
+    my $nfound = select($rbits, '', $ebits, $timeout);
+
+    # Idle timeout, or no more calls waiting?
+    if ($nfound == 0) {
+      last if $draining && !$full;
+      next if $adapting &&
+	!(defined $idle_timeout &&
+	  Time::HiRes::time() - $last_call >= $idle_timeout);
+      last;
+    }
     if ($nfound < 0) {
       next if $! == EINTR;
       fail_log("select failed: $!");
     }
 
+    if (vec($rbits, fileno(CHLDR), 1)) {
+      1 while (sysread(CHLDR, my $dummy, 4096) // 0) > 0;
+    }
+
     # Has the watcher told us to shut down, or died with a message ?
     my $msgbuf = '';
-    my $r = sysread WATCHE, $msgbuf, 2048;
-    if ($r > 0) {
-      chomp $msgbuf;
-      fail_log("watcher: $msgbuf");
+    my $r;
+    if ($draining) {
+      # We have already seen EOF
+    } elsif (($r = sysread WATCHE, $watchbuf, 2048,
+			  length $watchbuf) > 0) {
+      # There may be many unwatched lines, not all in one read
+      while ($watchbuf =~ s/^([^\n]*)\n//) {
+	my $m = $1;
+	if ($m =~ m/^reload (.*)/s) {
+	  syslog(LOG_INFO, "$0 prefork: reloading; due to $1");
+	  _exit(0);
+	} elsif ($m =~ m/^unwatched (.*)/s) {
+	  push @autoreload_stat_files, $1;
+	} else {
+	  fail_log("watcher: $m");
+	}
+      }
     } elsif (defined $r) {
+      fail_log("watcher: $watchbuf") if length $watchbuf;
+      # Calls already waiting on LISTEN would otherwise fail and have
+      # to retry.  Spares see EOF and quit, leaving them to us.
       syslog(LOG_INFO,
- "$0 prefork: lost socket (fresh start or cleanup?), quitting");
-      last;
+ "$0 prefork: lost socket (fresh start, reload or cleanup?), quitting");
+      $draining = 1;
+      if ($num_spares) {
+	close SPAREW;
+	$num_spares = 0;
+      }
+      next;
     } elsif ($! == EINTR || $! == EAGAIN || $! == EWOULDBLOCK) {
     } else {
       fail_log("watcher stderr read: $!");
     }
 
-    if (%opts{autoreload_inc} // 1) {
-      foreach my $f (values %INC) {
-	autoreload_check($f);
+    autoreload_check_all();
+
+    if ($num_spares) {
+      # Which spares have accepted calls ?
+      next unless vec($rbits, fileno(BUSYR), 1);
+      $r = sysread BUSYR, $msgbuf, 4096;
+      if (!defined $r) {
+	next if $! == EINTR;
+	fail_log("spares pipe read: $!");
       }
-    }
-    foreach my $f (@autoreload_extra_files) {
-      autoreload_check($f);
-    }
-    foreach my $f (@{ %opts{autoreload_extra} // [] }) {
-      autoreload_check($f);
+      foreach my $pid (unpack "N*", $msgbuf) {
+	$children{$pid} = 1 if exists $children{$pid};
+      }
+      $last_call = Time::HiRes::time() if length $msgbuf;
+      $errcount = 0;
+      next;
     }
 
     # Anything to accept ?
+    next if $full;
     if (accept(CALL, LISTEN)) {
+      $accept_time = trace_now();
+      $last_call = Time::HiRes::time();
       $child = fork // fail_log("fork for accepted call failed: $!");
       if (!$child) {
 	#---- monitor [1] ----
 	$0 =~ s{ \[server\]$}{ [monitor]};
-	return become_monitor();
+	return become_monitor(0);
       }
       close(CALL);
       $errcount = 0;
@@ -340,7 +877,7 @@ sub prefork_initialisation_complete {
     } elsif ($! == EINTR || $! == EAGAIN || $! == EWOULDBLOCK) {
     } else {
       syslog(LOG_WARNING, "$0 prefork: accept failed: $!");
-      if ($errcount > ($opts{max_errors} // 100)) {
+      if (++$errcount > $max_errors) {
 	fail_log("too many accept failures, quitting");
       }
     }
@@ -439,6 +976,13 @@ The exit status of the script will be reproduced
 as the exit status of C<prefork-interp>,
 so that the caller sees the right exit status.
 
+C<prefork-interp --batch> makes many calls, one after another,
+usually over a single connection.
+They are then all handled by the same monitor process,
+each in a fresh executor forked from it,
+sharing its process group
+(and anything left in that group is killed after each call).
+
 =head1 DESCRIPTORS AND OTHER INHERITED PROCESS PROPERTIES
 
 The per-invocation child inherits everything that is
@@ -472,6 +1016,48 @@ The set of files checked in this way can be modified
 via initialisation-complete options,
 or by calling C<prefork_autoreload_also_check>.
 
+The files are checked when the server starts.
+After that, if C<prefork-interp> is new enough,
+they are watched for changes (with inotify) by its watcher process,
+so that the server need not stat them all before each call;
+the server reloads as soon as one changes, or is renamed or deleted.
+Files which cannot be watched, and all the files
+with an older C<prefork-interp>, are checked as each call arrives.
+Files which do not exist are not checked at all.
+
+Normally, the next call after a change starts the fresh server,
+and must wait for it.
+With the C<autoreload_warm> option,
+if the files are being watched,
+the watcher instead starts the fresh server in the background,
+as soon as it sees the change,
+and puts it in place only once it has reached
+C<prefork_initialisation_complete>;
+the old server then finishes the calls already made to it, and exits.
+So callers never wait for a reload,
+but calls made while the fresh server is starting are handled by the old one,
+and the script's initialisation must be fit to be run
+without anyone waiting for it
+(its output, including any error messages, is discarded).
+If the fresh server fails to start,
+the next call starts one in the ordinary way,
+so the errors are seen then.
+
+=head1 TRACING
+
+If an invocation's environment has C<PREFORK_INTERP_TRACE> set
+(eg by C<prefork-interp --trace>),
+the library notes when the call was accepted,
+when its request had been received,
+when the process which returns from C<prefork_initialisation_complete>
+was forked (or handed the call),
+and when it is about to return,
+and sends these times to C<prefork-interp> along with the exit status.
+C<prefork-interp> then logs them with its own.
+
+The variable is left in C<%ENV>, along with the rest of the caller's
+environment.
+
 =head1 STANDALONE OPERATION
 
 A script which loads Proc::Prefork::Interp
@@ -503,13 +1089,55 @@ in the format used for initalising a Perl hash:
 
 =item C<< max_servers => I<MAX> >>
 
-Allow I<MAX> (an integer) concurrent invocations at once.
+Allow at most I<MAX> (an integer) concurrent invocations at once.
 If too many invocations arrive at once,
 new ones won't be served until some of them complete.
 
+The actual limit varies, according to load,
+between C<min_servers> and I<MAX>;
+normally it is C<target_servers>,
+but it is raised (by one every half second or so)
+while invocations are waiting and there is a CPU to spare,
+and lowered quickly if the system is short of memory
+(according to F</proc/pressure/memory>, or failing that
+I<MemAvailable> in F</proc/meminfo>).
+Changes are logged (at C<LOG_INFO>).
+
 If I<MAX> is negative, there is no limit.
 The limit is only applied somewhat approximately.
-Default is 4.
+Default is twice the number of CPUs, or 4 if that is more.
+
+=item C<< target_servers => I<NUM> >>
+
+The usual limit on concurrent invocations (see C<max_servers>).
+Default is C<max_servers> if that was specified
+(so that the limit only ever goes down, under memory pressure),
+or otherwise 4.
+
+=item C<< min_servers => I<NUM> >>
+
+The limit on concurrent invocations is never lowered below I<NUM>.
+Default is 1.
+
+=item C<< spare_servers => I<NUM> >>
+
+Keep I<NUM> idle processes ready to service invocations.
+Each waits for an invocation itself,
+so that an invocation does not have to wait for the server to fork;
+another spare is forked after it picks one up.
+Spares count towards the limit on concurrent invocations
+(see C<max_servers>).
+
+0 means the server accepts each invocation and then forks to service it.
+Default is 1.
+
+=item C<< spare_executors => I<BOOL> >>
+
+If set trueish (the default),
+each spare process also forks, in advance,
+the process which will return from C<prefork_initialisation_complete>,
+so that there is no fork at all between an invocation
+being accepted and the script continuing.
 
 =item C<< idle_timeout => I<TIMEOUT> >>
 
@@ -518,6 +1146,16 @@ future invocations would involve a restart.
 
 If I<TIMEOUT> is negative, we don't time out.
 
+=item C<< env_delta => I<BOOL> >>
+
+If set trueish (the default),
+invocations whose environment is mostly the same as the
+environment the script was started with
+need only send the differences.
+The environment is taken as at the call to
+C<prefork_initialisation_complete>;
+if the script has changed it by then, this has no effect.
+
 =item C<< autoreload_inc => I<BOOL> >>
 
 If set falseish,
@@ -532,6 +1170,13 @@ Additional paths to check for reloads
 See L</"AUTOMATIC RELOADING">.
 Default is 1 megasecond.
 
+=item C<< autoreload_warm => I<BOOL> >>
+
+If true, reload "warm": start the fresh server in the background,
+and only replace this one once it is ready.
+See L</"AUTOMATIC RELOADING">.
+Default is false.
+
 =item C<< max_errors => I<NUMBER> >>
 
 If our server loop experiences more errors than this, we quit.